@@ -16,38 +16,35 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include "atop.h"
-
 #define _POSIX_C_SOURCE 200809L
 
+#include "atop.h"
+#include "chess.h"
+#include "cmd.h"
+#include "db.h"
+#include "tb.h"
+
+#include <errno.h>
 #include <gtk/gtk.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define M_PI 3.14159265358979323846
 
-#define signum(x) (((x) > 0) - ((x) < 0))
-
-#define PAWN   1
-#define KNIGHT 2
-#define BISHOP 3
-#define ROOK   4
-#define QUEEN  5
-#define KING   6
-#define NP     KING
-
-// converting coordinates between one and two dimensional representations
-#define SQ(x,y) ((x)*8+(y))
-#define X(sq) ((sq)/8)
-#define Y(sq) ((sq)%8)
-
 // add and remove CSS classes on widgets
 #define ADD_CLASS(x,k) gtk_style_context_add_class(gtk_widget_get_style_context(GTK_WIDGET(x)), (k))
 #define DEL_CLASS(x,k) gtk_style_context_remove_class(gtk_widget_get_style_context(GTK_WIDGET(x)), (k))
 
 static GtkDrawingArea *draw;
 static GtkGrid *moves;
+static GtkTreeView *overview;
+static GtkTreeStore *overview_store;
+static int frame_due;   // whether the board has changed since it was drawn
 
 // global state signifying which move description is currently being edited
 static GtkTextView *edit_text;
@@ -58,127 +55,171 @@ static int click_x, click_y, hover_x, hover_y;
 static float offset_x, offset_y;
 static struct move *hover_move;
 
-static int pieces[8][8];
+static struct position pos;
 static int legal[8][8];
 static int clicked;
 static int current_check;
-static int cwk, cwq, cbk, cbq;
 
-// board history, used for going back with right click
-static int **hist;
-int nhist;
+// board history, used for going back with right click (pos.ply entries long)
+static int (**hist)[8];
 
 static cairo_surface_t *img_piece[NP*2+1];
 static cairo_surface_t *img_dark;
 static cairo_surface_t *img_light;
 
-// each move has exactly one child, which is a linked list representing all the
-// stored moves from that position
-// all of the elements of this linked list have their parent set to the same
-// node to facilitate navigation
-struct move {
-    int from;
-    int to;
-    char *desc;
-    struct move *next;
-    struct move *child;
-    struct move *parent;
-};
 struct move *db;
 struct move *cur_node;
-static struct move* new_node() {
-    struct move *node = malloc(sizeof *node);
-    node->desc = NULL;
-    node->next = NULL;
-    node->child = NULL;
-    node->parent = NULL;
-    return node;
-}
-
-// the following function reads the database file and initializes the db pointer
-#define BUF_SIZE 1024
-#define PENDING_FROM 0
-#define PENDING_TO   1
-#define READING_DESC 2
-static void initialize_db() {
-    // initialize root node (from and to values are irrelevant)
-    db = new_node();
-    struct move *cur = db;
-    cur_node = db;
 
-    FILE *f = fopen("atop.db", "rb");
-    if (!f) return;
-    unsigned char buf[BUF_SIZE];
-    size_t nread = 0;
-
-    size_t idx = 0,               // current index into buf that is being read
-           state = PENDING_FROM,  // what are we reading?
-           child = 1;             // state variable telling whether to add a
-                                  // new node as a child or a sibling
-    while (idx != nread || (idx = 0, (nread = fread(buf, 1, BUF_SIZE, f)) > 0)) {
-        switch (state) {
-            case PENDING_FROM:
-                // waiting for a new node - if we see FF, we go up one level
-                if (buf[idx] == 0xff) {
-                    if (child) child = 0;
-                    else if (cur->parent) cur = cur->parent;
-                    else goto done;
-                } else {
-                    struct move *new = new_node();
-                    new->from = buf[idx];
-                    if (child) new->parent = cur, cur->child = new, cur = new;
-                    else new->parent = cur->parent, cur->next = new, cur = new;
-                    state = PENDING_TO;
-                }
-                ++idx;
-                break;
-            case PENDING_TO:
-                cur->to = buf[idx++];
-                state = READING_DESC;
-                break;
-            case READING_DESC: {
-                size_t max = nread - idx,
-                       len = strnlen((const char*)buf + idx, max),
-                       prevlen = cur->desc ? strlen(cur->desc) : 0;
-
-                cur->desc = realloc(cur->desc, prevlen + len + 1);
-                strncpy(cur->desc + prevlen, (const char*)buf + idx, len);
-                cur->desc[prevlen + len] = '\0';
-
-                idx += len;
-                if (max != len) {
-                    child = 1;
-                    state = PENDING_FROM;
-                    ++idx;
-                }
-                break;
-            }
-        }
+// the database file may be shared by any number of instances, each of which
+// locks it around every change and merges in those made by the others
+static const char *db_path = "atop.db";
+static uint64_t db_gen;         // generation we last read or wrote
+static struct stat db_stat;     // and the state of the file at that point
+static int db_lock_fd = -1;
+static int moves_stale;         // db has changed under the sidebar
+
+// reading and writing the whole file is left to threads, so that the window
+// never waits on it; db is only read while a save is under way, and the
+// threads report back through an idle callback, on the main loop
+// (a file that someone else saved is read on a thread and then merged in on
+// the main loop, but a change, which needs the lock, reads it right there)
+struct file_state {
+    struct move *root;      // as read (NULL for a save)
+    const char *damage;
+    uint64_t gen;
+    struct stat st;
+    int lock_fd;            // released once saved
+    int err;
+};
+static pthread_t loader, saver;
+static int loading, saving;
+static uint64_t loading_from;   // db_gen when the load started
+static struct file_state loaded, saved;
+
+static void remember_db() {
+    db_gen = db_generation(db_path);
+    if (stat(db_path, &db_stat)) memset(&db_stat, 0, sizeof db_stat);
+}
+
+static void forget_prepared();
+static void prepare_ahead();
+static void update_overview();
+
+// merges the tree read from the file into db
+// the nodes of the current line, and those listed in the sidebar (whose
+// widgets point at them), survive even if they were deleted elsewhere
+static void merge_in(struct move *disk, struct move *target) {
+    size_t nkeep = 4;
+    for (struct move *m = cur_node->child; m; m = m->next) ++nkeep;
+    struct move **keep = malloc(nkeep * sizeof *keep);
+    keep[0] = cur_node;
+    keep[1] = edit_text ? edit_move : NULL;
+    keep[2] = hover_move;
+    keep[3] = target;
+    nkeep = 4;
+    for (struct move *m = cur_node->child; m; m = m->next) keep[nkeep++] = m;
+
+    if (db_merge(db, disk, keep, nkeep)) {
+        moves_stale = 1;
+        forget_prepared();
+        update_overview();
     }
+    free(keep);
+}
 
-done:
-    fclose(f);
+// brings db up to date with the file if someone else has saved it since we
+// last looked (must be called with the lock held)
+// a file that can't be read in full is left alone rather than taken for an
+// empty or cut down database, which would drop everything it's missing
+static void merge_db(struct move *target) {
+    if (db_generation(db_path) == db_gen) return;
+    const char *damage;
+    struct move *disk = db_read(db_path, &damage);
+    if (damage) {
+        db_free(disk);
+        return;
+    }
+    merge_in(disk, target);
+    remember_db();
 }
 
-// recursive function to simplify save_db
-static void write_node(FILE *f, struct move *node) {
-    if (!node) return;
+static void* free_thread(void *arg) {
+    db_free(arg);
+    return NULL;
+}
 
-    fputc(node->from, f);
-    fputc(node->to, f);
-    fputs(node->desc, f);
-    fputc(0, f);
-    write_node(f, node->child);
-    fputc(255, f);
-    write_node(f, node->next);
+// frees a tree read from the file that turned out not to be needed
+static void free_later(struct move *root) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, free_thread, root)) db_free(root);
+    else pthread_detach(tid);
 }
 
-// saves db to the database file
-static void save_db() {
-    FILE *f = fopen("atop.db", "wb");
-    write_node(f, db->child);
-    fputc(255, f);
-    fclose(f);
+static void* save_thread(void *arg) {
+    struct file_state *f = arg;
+    f->err = db_save(db, db_path);
+    // (taken before unlocking, so that it's our save and no one else's)
+    f->gen = db_generation(db_path);
+    if (stat(db_path, &f->st)) memset(&f->st, 0, sizeof f->st);
+    db_unlock(f->lock_fd);
+    return NULL;
+}
+
+// waits for the save under way, if any (which must be done before db changes)
+static void finish_saving() {
+    if (!saving) return;
+    pthread_join(saver, NULL);
+    saving = 0;
+    if (saved.err) perror(db_path);
+    db_gen = saved.gen;
+    db_stat = saved.st;
+}
+
+static gboolean saved_db(gpointer data) {
+    (void)data;
+    finish_saving();
+    return G_SOURCE_REMOVE;
+}
+
+static void* save_and_report(void *arg) {
+    save_thread(arg);
+    g_idle_add(saved_db, NULL);
+    return NULL;
+}
+
+// reads the database file and initializes the db pointer
+static void initialize_db() {
+    db_lock_fd = db_lock(db_path);
+    db = db_load(db_path);
+    remember_db();
+    db_unlock(db_lock_fd);
+    cur_node = db;
+}
+
+// every change to db is made between these two calls: the first takes the
+// lock and merges in other changes to the file (target, the node about to be
+// changed, is kept around regardless), the second saves db if it was changed
+// and releases the lock
+static void begin_change(struct move *target) {
+    finish_saving();
+    db_lock_fd = db_lock(db_path);
+    merge_db(target);
+}
+
+// (the save goes on on a thread, which also releases the lock)
+static void end_change(int save) {
+    if (save) {
+        saved = (struct file_state){ .lock_fd = db_lock_fd };
+        saving = 1;
+        if (pthread_create(&saver, NULL, save_and_report, &saved)) {
+            save_thread(&saved);
+            saving = 0;
+            if (saved.err) perror(db_path);
+            db_gen = saved.gen;
+            db_stat = saved.st;
+        }
+    } else db_unlock(db_lock_fd);
+    db_lock_fd = -1;
 }
 
 // this function finalizes the move description currently being edited
@@ -208,9 +249,11 @@ static void save_edit() {
     }
 
     // update in the database
-    free(edit_move->desc);
-    edit_move->desc = desc;
-    save_db();
+    begin_change(edit_move);
+    db_set_desc(edit_move, desc);
+    end_change(1);
+    g_free(desc);
+    update_overview();
 
     // reset global state (setting edit_move to NULL isn't really necessary
     // because no other code cares about it)
@@ -232,7 +275,10 @@ static void request_edit(struct move *move, GtkGrid *parent, int y) {
     edit_text = GTK_TEXT_VIEW(gtk_text_view_new());
     gtk_text_buffer_set_text(gtk_text_view_get_buffer(edit_text), move->desc, -1);
     gtk_text_view_set_wrap_mode(edit_text, GTK_WRAP_WORD_CHAR);
-    gtk_grid_attach(parent, GTK_WIDGET(edit_text), 0, y, 1, 1);
+    // (y is 0 for a move just added, whose sidebar is empty but for any
+    // tablebase verdict, which the text view goes below)
+    if (y) gtk_grid_attach(parent, GTK_WIDGET(edit_text), 0, y, 1, 1);
+    else gtk_grid_attach_next_to(parent, GTK_WIDGET(edit_text), NULL, GTK_POS_BOTTOM, 1, 1);
     gtk_widget_set_size_request(GTK_WIDGET(edit_text), 256, 0);
     gtk_widget_show(GTK_WIDGET(edit_text));
     gtk_widget_grab_focus(GTK_WIDGET(edit_text));
@@ -259,6 +305,8 @@ static gboolean edit(GtkWidget *widget, GdkEventButton *event, gpointer data) {
     return TRUE;
 }
 
+static void update_moves();
+
 // called when the user clicks the delete icon in the corner
 static gboolean delete(GtkWidget *widget, GdkEventButton *event, gpointer data) {
     (void)event;
@@ -269,25 +317,21 @@ static gboolean delete(GtkWidget *widget, GdkEventButton *event, gpointer data)
     gtk_container_remove(GTK_CONTAINER(gtk_widget_get_parent(row)), row);
 
     // remove the move in the database
-    struct move *prev = NULL;
-    for (struct move *m = move->parent->child; m; m = m->next) {
-        if (m == move) {
-            if (prev) prev->next = m->next;
-            else m->parent->child = m->next;
-            free(m->desc);
-            free(m);
-            break;
-        }
-        prev = m;
-    }
-
-    save_db();
+    begin_change(move);
+    if (hover_move == move) hover_move = NULL;
+    db_remove(move);
+    end_change(1);
+    forget_prepared();
+    update_overview();
+    if (moves_stale) update_moves();
+    else prepare_ahead();
 
     return TRUE;
 }
 
 void redraw() {
-    gtk_widget_queue_draw_area(GTK_WIDGET(draw), 0, 0, 512, 512);
+    frame_due = 1;
+    if (draw) gtk_widget_queue_draw_area(GTK_WIDGET(draw), 0, 0, 512, 512);
 }
 
 // the following three functions pertain to the move list in the sidebar
@@ -320,41 +364,191 @@ static gboolean move_left(GtkWidget *widget, GdkEventCrossing *event, gpointer d
     return TRUE;
 }
 
-// convert from and to coords into algebraic notation
-static int in_check(int board[8][8], int color, int fx, int fy, int tx, int ty, int mate);
-static char* algebraic(int fx, int fy, int tx, int ty) {
-    char *buf = malloc(10);
-    int idx = 0;
-    int type = abs(pieces[fx][fy]);
-    if (type == KING && abs(tx - fx) == 2) {
-        buf[idx++] = 'O'; buf[idx++] = '-'; buf[idx++] = 'O';
-        if (tx < fx) { buf[idx++] = '-'; buf[idx++] = 'O'; }
-    } else {
-        if (type == PAWN) {
-            if (pieces[tx][ty]) buf[idx++] = 'a' + fx;
-        } else buf[idx++] = "  NBRQK"[type];
-        if (pieces[tx][ty]) buf[idx++] = 'x';
-        buf[idx++] = 'a' + tx;
-        buf[idx++] = '8' - ty;
+// the following functions work out ahead of time, while nothing else is
+// going on, what the board and the sidebar will need for the moves the user
+// is likely to make next: the current node's children, and the children of
+// its first child (the main line), as well as the current node itself, for
+// when it hasn't been reached through one of those
+// nodes are prepared one per idle callback, so that events never wait on more
+// than one, and everything is forgotten whenever nodes might have been freed
+// (all the same, nothing is used unless it's for the position actually on the
+// board, and the child it was worked out for, so that a node freed without
+// that and another one made in its place can't bring back a stale entry)
+#define PREPARE_MAX 64
+
+struct prepared_head {
+    struct move *node;
+    unsigned char from, to;
+    char *text;             // algebraic() of node's move
+};
+
+struct prepared {
+    struct move *node;
+    struct position pos;    // after node's move
+    int check;              // as in current_check
+    int tb, tb_plies;       // what tb_probe says about pos
+    struct prepared_head *heads;    // one for each of node's children
+    size_t nheads;
+    uint64_t legal[64];     // the squares each piece on pos can move to
+};
+static struct prepared prepared[PREPARE_MAX];
+static size_t nprepared;
+static struct move *prepare_queue[PREPARE_MAX];
+static size_t nqueued, next_queued;
+static guint prepare_source;
+static int prepare_by_hand;     // uibench runs the queue itself
+static size_t prepared_hits, prepared_lookups;  // reported by uibench
+
+static struct prepared* prepared_for(struct move *node) {
+    for (size_t i = 0; i < nprepared; ++i) {
+        if (prepared[i].node == node) return &prepared[i];
+    }
+    return NULL;
+}
+
+static void drop_prepared(size_t i) {
+    for (size_t j = 0; j < prepared[i].nheads; ++j) free(prepared[i].heads[j].text);
+    free(prepared[i].heads);
+    prepared[i] = prepared[--nprepared];
+}
+
+// looks node up for use with the position after it (that's on the board),
+// keeping count of how often that pays off; an entry for another position is
+// thrown away
+static struct prepared* use_prepared(struct move *node, struct position *after) {
+    struct prepared *p = prepared_for(node);
+    ++prepared_lookups;
+    if (p && memcmp(&p->pos, after, sizeof *after)) {
+        drop_prepared(p - prepared);
+        p = NULL;
+    }
+    if (p) ++prepared_hits;
+    return p;
+}
+
+// the head prepared for the nth child m, or NULL
+static const char* prepared_head(struct prepared *p, size_t n, struct move *m) {
+    if (!p || n >= p->nheads) return NULL;
+    struct prepared_head *h = &p->heads[n];
+    return h->node == m && h->from == m->from && h->to == m->to ? h->text : NULL;
+}
+
+static void stop_preparing() {
+    if (prepare_source) g_source_remove(prepare_source);
+    prepare_source = 0;
+    nqueued = next_queued = 0;
+}
+
+static void forget_prepared() {
+    stop_preparing();
+    while (nprepared) drop_prepared(0);
+}
+
+// prepares the next node in the queue, returning 0 once there are none left
+static int prepare_one() {
+    while (next_queued < nqueued) {
+        struct move *node = prepare_queue[next_queued++];
+        if (prepared_for(node) || nprepared == PREPARE_MAX) continue;
+
+        // the node is the current one, or its parent is, or else its parent
+        // has been prepared already
+        struct prepared *parent = node->parent ? prepared_for(node->parent) : NULL;
+        struct prepared *p = &prepared[nprepared];
+        if (node != cur_node && node->parent != cur_node && !parent) continue;
+        p->node = node;
+        if (node == cur_node) p->pos = pos;
+        else {
+            p->pos = node->parent == cur_node ? pos : parent->pos;
+            position_move(&p->pos, X(node->from), Y(node->from), X(node->to), Y(node->to));
+        }
+        p->check = in_check(p->pos.pieces, position_color(&p->pos), -1, -1, -1, -1, 0);
+        p->tb = tb_probe(&p->pos, &p->tb_plies);
+
+        p->nheads = 0;
+        for (struct move *m = node->child; m; m = m->next) ++p->nheads;
+        p->heads = malloc((p->nheads ? p->nheads : 1) * sizeof *p->heads);
+        size_t i = 0;
+        for (struct move *m = node->child; m; m = m->next) {
+            p->heads[i++] = (struct prepared_head){ m, m->from, m->to,
+                algebraic(&p->pos, X(m->from), Y(m->from), X(m->to), Y(m->to)) };
+        }
+
+        int color = position_color(&p->pos);
+        for (int x = 0; x < 8; ++x) {
+            for (int y = 0; y < 8; ++y) {
+                int piece = p->pos.pieces[x][y], arr[8][8] = {{0}};
+                p->legal[SQ(x, y)] = 0;
+                if (piece * color <= 0) continue;
+                update_legal(arr, p->pos.pieces, abs(piece), color, x, y, 1, castle_rights(&p->pos, color));
+                for (int sq = 0; sq < 64; ++sq) {
+                    if (arr[X(sq)][Y(sq)]) p->legal[SQ(x, y)] |= (uint64_t)1 << sq;
+                }
+            }
+        }
+        ++nprepared;
+        return 1;
     }
-    switch (in_check(pieces, nhist%2*2-1, fx, fy, tx, ty, 1)) {
-        case 1: buf[idx++] = '+'; break;
-        case 2: buf[idx++] = '#'; break;
+    return 0;
+}
+
+static gboolean prepare_idle(gpointer data) {
+    (void)data;
+    if (prepare_one()) return G_SOURCE_CONTINUE;
+    prepare_source = 0;
+    return G_SOURCE_REMOVE;
+}
+
+// starts over on the queue for the current node, keeping whatever has been
+// prepared already for it or ahead of it
+static void prepare_ahead() {
+    stop_preparing();
+    for (size_t i = 0; i < nprepared; ) {
+        struct move *n = prepared[i].node;
+        if (n == cur_node || n->parent == cur_node || (n->parent && n->parent->parent == cur_node)) ++i;
+        else drop_prepared(i);
     }
-    buf[idx] = '\0';
-    return buf;
+
+    prepare_queue[nqueued++] = cur_node;
+    for (struct move *m = cur_node->child; m && nqueued < PREPARE_MAX; m = m->next) {
+        prepare_queue[nqueued++] = m;
+    }
+    if (cur_node->child) {
+        for (struct move *m = cur_node->child->child; m && nqueued < PREPARE_MAX; m = m->next) {
+            prepare_queue[nqueued++] = m;
+        }
+    }
+    if (!prepare_by_hand) prepare_source = g_idle_add_full(G_PRIORITY_LOW, prepare_idle, NULL, NULL);
 }
 
 // this function refreshes the movelist in the sidebar
 static void update_moves() {
+    moves_stale = 0;
+    prepare_ahead();
+    // (there's no sidebar when benchmarking without a display)
+    if (!moves) return;
     gtk_container_foreach(GTK_CONTAINER(moves), (GtkCallback)gtk_widget_destroy, NULL);
 
-    for (struct move *m = cur_node->child; m; m = m->next) {
+    // in endgames covered by a tablebase, the verdict heads the list
+    struct prepared *ready = use_prepared(cur_node, &pos);
+    int plies, result = ready ? ready->tb : tb_probe(&pos, &plies);
+    if (ready) plies = ready->tb_plies;
+    if (result != TB_NONE) {
+        char verdict[64];
+        if (result == 0) strcpy(verdict, "tablebase: draw");
+        else sprintf(verdict, "tablebase: %s in %d", result > 0 ? "win" : "loss", plies);
+        GtkLabel *tb = GTK_LABEL(gtk_label_new(verdict));
+        ADD_CLASS(tb, "tb");
+        gtk_grid_attach_next_to(moves, GTK_WIDGET(tb), NULL, GTK_POS_BOTTOM, 1, 1);
+    }
+
+    size_t i = 0;
+    for (struct move *m = cur_node->child; m; m = m->next, ++i) {
         GtkGrid *container = GTK_GRID(gtk_grid_new());
         GtkOverlay *overlay = GTK_OVERLAY(gtk_overlay_new());
 
-        char *header = algebraic(X(m->from), Y(m->from), X(m->to), Y(m->to));
-        GtkLabel *head = GTK_LABEL(gtk_label_new(header));
+        const char *ready_head = prepared_head(ready, i, m);
+        char *header = ready_head ? NULL : algebraic(&pos, X(m->from), Y(m->from), X(m->to), Y(m->to));
+        GtkLabel *head = GTK_LABEL(gtk_label_new(ready_head ? ready_head : header));
         gtk_widget_set_size_request(GTK_WIDGET(head), 256, 0);
         ADD_CLASS(head, "head");
         free(header);
@@ -393,191 +587,164 @@ static void update_moves() {
     gtk_widget_show_all(GTK_WIDGET(moves));
 }
 
-static void initialize_images() {
-    img_piece[NP-PAWN]   = cairo_image_surface_create_from_png("img/bp.png");
-    img_piece[NP-KNIGHT] = cairo_image_surface_create_from_png("img/bn.png");
-    img_piece[NP-BISHOP] = cairo_image_surface_create_from_png("img/bb.png");
-    img_piece[NP-ROOK]   = cairo_image_surface_create_from_png("img/br.png");
-    img_piece[NP-QUEEN]  = cairo_image_surface_create_from_png("img/bq.png");
-    img_piece[NP-KING]   = cairo_image_surface_create_from_png("img/bk.png");
-    img_piece[NP+PAWN]   = cairo_image_surface_create_from_png("img/wp.png");
-    img_piece[NP+KNIGHT] = cairo_image_surface_create_from_png("img/wn.png");
-    img_piece[NP+BISHOP] = cairo_image_surface_create_from_png("img/wb.png");
-    img_piece[NP+ROOK]   = cairo_image_surface_create_from_png("img/wr.png");
-    img_piece[NP+QUEEN]  = cairo_image_surface_create_from_png("img/wq.png");
-    img_piece[NP+KING]   = cairo_image_surface_create_from_png("img/wk.png");
-    img_dark  = cairo_image_surface_create_from_png("img/black.png");
-    img_light = cairo_image_surface_create_from_png("img/white.png");
+// the following functions pertain to the overview of the whole book, a tree
+// whose rows are only added when their parent is first expanded (until then,
+// a row with moves below it just has a placeholder row without a node)
+// the totals it shows are read straight from the nodes as rows are drawn, so
+// they're always current, and only the rows need keeping in line with db,
+// which is done whenever db changes (and not on mere navigation)
+enum { OVERVIEW_NODE, OVERVIEW_MOVE, OVERVIEW_COLUMNS };
+enum { SHOW_BELOW, SHOW_DEPTH, SHOW_EMPTY, SHOW_DESC };
+
+// the position reached by the line to node
+static void position_at(struct move *node, struct position *out) {
+    size_t depth = 0;
+    for (struct move *m = node; m->parent; m = m->parent) ++depth;
+    struct move **line = malloc((depth ? depth : 1) * sizeof *line);
+    size_t i = depth;
+    for (struct move *m = node; m->parent; m = m->parent) line[--i] = m;
+
+    position_init(out);
+    for (i = 0; i < depth; ++i) {
+        position_move(out, X(line[i]->from), Y(line[i]->from), X(line[i]->to), Y(line[i]->to));
+    }
+    free(line);
 }
 
-static void simulate_move(int board[8][8], int fx, int fy, int tx, int ty) {
-    if (board[tx][ty]) {
-        board[tx][ty] = 0;
-        if (tx-1 >= 0 && ty-1 >= 0 && abs(board[tx-1][ty-1]) != 1) board[tx-1][ty-1] = 0;
-        if (tx-1 >= 0              && abs(board[tx-1][ty])   != 1) board[tx-1][ty]   = 0;
-        if (tx-1 >= 0 && ty+1 <  8 && abs(board[tx-1][ty+1]) != 1) board[tx-1][ty+1] = 0;
-        if (             ty-1 >= 0 && abs(board[tx][ty-1])   != 1) board[tx][ty-1]   = 0;
-        if (             ty+1 <  8 && abs(board[tx][ty+1])   != 1) board[tx][ty+1]   = 0;
-        if (tx+1 <  8 && ty-1 >= 0 && abs(board[tx+1][ty-1]) != 1) board[tx+1][ty-1] = 0;
-        if (tx+1 <  8              && abs(board[tx+1][ty])   != 1) board[tx+1][ty]   = 0;
-        if (tx+1 <  8 && ty+1 <  8 && abs(board[tx+1][ty+1]) != 1) board[tx+1][ty+1] = 0;
-    } else board[tx][ty] = board[fx][fy];
-    board[fx][fy] = 0;
-
-    // resolve castling if it occurred
-    if (abs(board[tx][ty]) == KING && abs(tx - fx) == 2) {
-        int rx = tx > fx ? 7 : 0;
-        board[tx - signum(tx - fx)][ty] = board[rx][ty];
-        board[rx][ty] = 0;
-    }
-}
-
-static void update_legal(int arr[8][8], int board[8][8], int type, int color, int fx, int fy, int check);
-static int in_check(int board[8][8], int color, int fx, int fy, int tx, int ty, int mate) {
-    // copy the board and do the move
-    int new_board[8][8], new_legal[8][8];
-    memcpy(new_board, board, sizeof new_board);
-    if (fx != -1) simulate_move(new_board, fx, fy, tx, ty);
-
-    // locate the king
-    int kx, ky;
-    for (int i = 0; i < 8; ++i) {
-        for (int j = 0; j < 8; ++j) {
-            if (new_board[i][j] == color*KING) {
-                kx = i;
-                ky = j;
-                goto endfor;
-            }
-        }
+// makes the row at it stand for m (made from pos), collapsed
+static void overview_set(GtkTreeIter *it, struct move *m, struct position *pos) {
+    char *move = algebraic(pos, X(m->from), Y(m->from), X(m->to), Y(m->to));
+    gtk_tree_store_set(overview_store, it, OVERVIEW_NODE, m, OVERVIEW_MOVE, move, -1);
+    free(move);
+
+    GtkTreeIter child;
+    while (gtk_tree_model_iter_children(GTK_TREE_MODEL(overview_store), &child, it)) {
+        gtk_tree_store_remove(overview_store, &child);
     }
-    return 2; // king was exploded - checkmate
-    endfor:{}
+    if (m->child) gtk_tree_store_append(overview_store, &child, it);
+}
 
-    // connected kings are never in check
-    if (kx-1 >= 0 && ky-1 >= 0 && new_board[kx-1][ky-1] == -color*KING) return 0;
-    if (kx-1 >= 0              && new_board[kx-1][ky]   == -color*KING) return 0;
-    if (kx-1 >= 0 && ky+1 <  8 && new_board[kx-1][ky+1] == -color*KING) return 0;
-    if (             ky-1 >= 0 && new_board[kx][ky-1]   == -color*KING) return 0;
-    if (             ky+1 <  8 && new_board[kx][ky+1]   == -color*KING) return 0;
-    if (kx+1 <  8 && ky-1 >= 0 && new_board[kx+1][ky-1] == -color*KING) return 0;
-    if (kx+1 <  8              && new_board[kx+1][ky]   == -color*KING) return 0;
-    if (kx+1 <  8 && ky+1 <  8 && new_board[kx+1][ky+1] == -color*KING) return 0;
+// whether the row at it has had its children added
+static int overview_filled(GtkTreeIter *it) {
+    GtkTreeIter child;
+    struct move *m = NULL;
+    if (!gtk_tree_model_iter_children(GTK_TREE_MODEL(overview_store), &child, it)) return 0;
+    gtk_tree_model_get(GTK_TREE_MODEL(overview_store), &child, OVERVIEW_NODE, &m, -1);
+    return m != NULL;
+}
 
-    // check for direct threats
-    for (int i = 0; i < 8; ++i) {
-        for (int j = 0; j < 8; ++j) {
-            if (signum(new_board[i][j]) != -color) continue;
-            new_legal[kx][ky] = 0;
-            update_legal(new_legal, new_board, abs(new_board[i][j]), -color, i, j, 0);
-            if (!new_legal[kx][ky]) continue;
-
-            // an enemy piece can legally take the king, so it's in check
-            if (!mate) return 1;
-            for (int ii = 0; ii < 8; ++ii) {
-                for (int jj = 0; jj < 8; ++jj) {
-                    if (color * new_board[ii][jj] <= 0) continue;
-                    memset(new_legal, 0, sizeof new_legal);
-                    update_legal(new_legal, new_board, abs(new_board[ii][jj]), color, ii, jj, 1);
-                    for (int iii = 0; iii < 8; ++iii) {
-                        for (int jjj = 0; jjj < 8; ++jjj) {
-                            if (new_legal[iii][jjj]) return 1;
-                        }
-                    }
-                }
-            }
-            return 2;
-        }
+// brings the rows below parent (the row for node, reached at pos, or NULL for
+// the top level) in line with db, along with any rows below them that have
+// been filled; a row that now stands for a different node is collapsed
+static void overview_sync(GtkTreeIter *parent, struct move *node, struct position *pos) {
+    GtkTreeModel *model = GTK_TREE_MODEL(overview_store);
+    GtkTreeIter it;
+    gboolean valid = gtk_tree_model_iter_children(model, &it, parent);
+    for (struct move *m = node->child; m; m = m->next) {
+        struct move *row = NULL;
+        if (!valid) gtk_tree_store_append(overview_store, &it, parent);
+        else gtk_tree_model_get(model, &it, OVERVIEW_NODE, &row, -1);
+
+        if (row != m) overview_set(&it, m, pos);
+        else if (overview_filled(&it)) {
+            struct position after = *pos;
+            position_move(&after, X(m->from), Y(m->from), X(m->to), Y(m->to));
+            overview_sync(&it, m, &after);
+        } else if (!m->child != !gtk_tree_model_iter_has_child(model, &it)) overview_set(&it, m, pos);
+
+        valid = valid && gtk_tree_model_iter_next(model, &it);
     }
+    while (valid) valid = gtk_tree_store_remove(overview_store, &it);
+}
 
-    return 0;
+static void update_overview() {
+    if (!overview) return;
+    struct position start;
+    position_init(&start);
+    overview_sync(NULL, db, &start);
+    gtk_widget_queue_draw(GTK_WIDGET(overview));
 }
 
-// updates the legal array, which gives the positions to which the currently
-// held piece can move
-#define TRY(tx,ty) do { if (!(check && in_check(board, color, fx, fy, tx, ty, 0))) arr[tx][ty] = 1; } while (0)
-static void update_legal(int arr[8][8], int board[8][8], int type, int color, int fx, int fy, int check) {
-    if (type == PAWN) {
-        if (!board[fx][fy-color]) {
-            TRY(fx, fy-color);
-            if ((color == 1 ? fy == 6 : fy == 1) && !board[fx][fy-2*color]) {
-                TRY(fx, fy-2*color);
-            }
-        }
-        if (fx > 0 && color*board[fx-1][fy-color] < 0) TRY(fx-1, fy-color);
-        if (fx < 7 && color*board[fx+1][fy-color] < 0) TRY(fx+1, fy-color);
-        return;
+static gboolean overview_expand(GtkTreeView *view, GtkTreeIter *it, GtkTreePath *path, gpointer data) {
+    (void)view; (void)path; (void)data;
+    if (overview_filled(it)) return FALSE;
+
+    struct move *node;
+    gtk_tree_model_get(GTK_TREE_MODEL(overview_store), it, OVERVIEW_NODE, &node, -1);
+    struct position pos;
+    position_at(node, &pos);
+
+    GtkTreeIter child;
+    gtk_tree_model_iter_children(GTK_TREE_MODEL(overview_store), &child, it);
+    gtk_tree_store_remove(overview_store, &child);
+    for (struct move *m = node->child; m; m = m->next) {
+        gtk_tree_store_append(overview_store, &child, it);
+        overview_set(&child, m, &pos);
     }
+    return FALSE;
+}
 
-    if (type == KNIGHT) {
-        if (fx+1 <  8 && fy+2 <  8 && color*board[fx+1][fy+2] <= 0) TRY(fx+1, fy+2);
-        if (fx+1 <  8 && fy-2 >= 0 && color*board[fx+1][fy-2] <= 0) TRY(fx+1, fy-2);
-        if (fx+2 <  8 && fy+1 <  8 && color*board[fx+2][fy+1] <= 0) TRY(fx+2, fy+1);
-        if (fx+2 <  8 && fy-1 >= 0 && color*board[fx+2][fy-1] <= 0) TRY(fx+2, fy-1);
-        if (fx-1 >= 0 && fy+2 <  8 && color*board[fx-1][fy+2] <= 0) TRY(fx-1, fy+2);
-        if (fx-1 >= 0 && fy-2 >= 0 && color*board[fx-1][fy-2] <= 0) TRY(fx-1, fy-2);
-        if (fx-2 >= 0 && fy+1 <  8 && color*board[fx-2][fy+1] <= 0) TRY(fx-2, fy+1);
-        if (fx-2 >= 0 && fy-1 >= 0 && color*board[fx-2][fy-1] <= 0) TRY(fx-2, fy-1);
-        return;
+static void overview_cell(GtkTreeViewColumn *column, GtkCellRenderer *cell,
+        GtkTreeModel *model, GtkTreeIter *it, gpointer data) {
+    (void)column;
+    struct move *m;
+    gtk_tree_model_get(model, it, OVERVIEW_NODE, &m, -1);
+    char text[16] = "";
+    if (m) switch (GPOINTER_TO_INT(data)) {
+        case SHOW_BELOW: sprintf(text, "%u", (unsigned)m->below); break;
+        case SHOW_DEPTH: sprintf(text, "%u", (unsigned)m->below_depth); break;
+        case SHOW_EMPTY: sprintf(text, "%u", (unsigned)m->below_empty); break;
+        case SHOW_DESC:
+            g_object_set(cell, "text", m->desc, NULL);
+            return;
     }
+    g_object_set(cell, "text", text, NULL);
+}
 
-    if (type == KING) {
-        if (fx-1 >= 0 && fy-1 >= 0 && !board[fx-1][fy-1]) TRY(fx-1, fy-1);
-        if (fx-1 >= 0              && !board[fx-1][fy])   TRY(fx-1, fy);
-        if (fx-1 >= 0 && fy+1 <  8 && !board[fx-1][fy+1]) TRY(fx-1, fy+1);
-        if (             fy-1 >= 0 && !board[fx][fy-1])   TRY(fx,   fy-1);
-        if (             fy+1 <  8 && !board[fx][fy+1])   TRY(fx,   fy+1);
-        if (fx+1 <  8 && fy-1 >= 0 && !board[fx+1][fy-1]) TRY(fx+1, fy-1);
-        if (fx+1 <  8              && !board[fx+1][fy])   TRY(fx+1, fy);
-        if (fx+1 <  8 && fy+1 <  8 && !board[fx+1][fy+1]) TRY(fx+1, fy+1);
-        if (check && !(color == 1 ? cwk : cbk) &&
-                !in_check(board, color, -1, -1, -1, -1, 0) &&
-                !in_check(board, color, fx, fy, fx+1, fy, 0) &&
-                !in_check(board, color, fx, fy, fx+2, fy, 0)) arr[fx+2][fy] = 1;
-        if (check && !(color == 1 ? cwq : cbq) &&
-                !in_check(board, color, -1, -1, -1, -1, 0) &&
-                !in_check(board, color, fx, fy, fx-1, fy, 0) &&
-                !in_check(board, color, fx, fy, fx-2, fy, 0) &&
-                !board[fx-3][fy]) arr[fx-2][fy] = 1;
-        return;
-    }
+static void add_overview_column(const char *title, int show, int width) {
+    GtkCellRenderer *cell = gtk_cell_renderer_text_new();
+    GtkTreeViewColumn *column = gtk_tree_view_column_new();
+    gtk_tree_view_column_set_title(column, title);
+    gtk_tree_view_column_pack_start(column, cell, TRUE);
+    if (show == -1) gtk_tree_view_column_add_attribute(column, cell, "text", OVERVIEW_MOVE);
+    else gtk_tree_view_column_set_cell_data_func(column, cell, overview_cell, GINT_TO_POINTER(show), NULL);
+    if (show == SHOW_DESC) g_object_set(cell, "ellipsize", PANGO_ELLIPSIZE_END, "single-paragraph-mode", TRUE, NULL);
+
+    // (fixed widths keep scrolling smooth however many rows are open)
+    gtk_tree_view_column_set_sizing(column, GTK_TREE_VIEW_COLUMN_FIXED);
+    gtk_tree_view_column_set_fixed_width(column, width);
+    gtk_tree_view_append_column(overview, column);
+}
 
-    if (type == ROOK || type == QUEEN) {
-        for (int i = 1; fx+i < 8; ++i) {
-            if (color*board[fx+i][fy] <= 0) TRY(fx+i, fy);
-            if (board[fx+i][fy]) break;
-        }
-        for (int i = 1; fx-i >= 0; ++i) {
-            if (color*board[fx-i][fy] <= 0) TRY(fx-i, fy);
-            if (board[fx-i][fy]) break;
-        }
-        for (int i = 1; fy+i < 8; ++i) {
-            if (color*board[fx][fy+i] <= 0) TRY(fx, fy+i);
-            if (board[fx][fy+i]) break;
-        }
-        for (int i = 1; fy-i >= 0; ++i) {
-            if (color*board[fx][fy-i] <= 0) TRY(fx, fy-i);
-            if (board[fx][fy-i]) break;
-        }
-    }
+static void initialize_overview(GtkBuilder *builder) {
+    overview = GTK_TREE_VIEW(gtk_builder_get_object(builder, "overview"));
+    overview_store = gtk_tree_store_new(OVERVIEW_COLUMNS, G_TYPE_POINTER, G_TYPE_STRING);
+    gtk_tree_view_set_model(overview, GTK_TREE_MODEL(overview_store));
+    add_overview_column("move", -1, 80);
+    add_overview_column("below", SHOW_BELOW, 64);
+    add_overview_column("depth", SHOW_DEPTH, 48);
+    add_overview_column("empty", SHOW_EMPTY, 48);
+    add_overview_column("description", SHOW_DESC, 160);
+    gtk_tree_view_set_fixed_height_mode(overview, TRUE);
+    g_signal_connect(overview, "test-expand-row", G_CALLBACK(overview_expand), NULL);
+    gtk_widget_set_size_request(GTK_WIDGET(gtk_builder_get_object(builder, "overview_scroll")), 256, 512);
+}
 
-    if (type == BISHOP || type == QUEEN) {
-        for (int i = 1; fx+i < 8 && fy+i < 8; ++i) {
-            if (color*board[fx+i][fy+i] <= 0) TRY(fx+i, fy+i);
-            if (board[fx+i][fy+i]) break;
-        }
-        for (int i = 1; fx+i < 8 && fy-i >= 0; ++i) {
-            if (color*board[fx+i][fy-i] <= 0) TRY(fx+i, fy-i);
-            if (board[fx+i][fy-i]) break;
-        }
-        for (int i = 1; fx-i >= 0 && fy+i < 8; ++i) {
-            if (color*board[fx-i][fy+i] <= 0) TRY(fx-i, fy+i);
-            if (board[fx-i][fy+i]) break;
-        }
-        for (int i = 1; fx-i >= 0 && fy-i >= 0; ++i) {
-            if (color*board[fx-i][fy-i] <= 0) TRY(fx-i, fy-i);
-            if (board[fx-i][fy-i]) break;
-        }
-    }
+static void initialize_images() {
+    img_piece[NP-PAWN]   = cairo_image_surface_create_from_png("img/bp.png");
+    img_piece[NP-KNIGHT] = cairo_image_surface_create_from_png("img/bn.png");
+    img_piece[NP-BISHOP] = cairo_image_surface_create_from_png("img/bb.png");
+    img_piece[NP-ROOK]   = cairo_image_surface_create_from_png("img/br.png");
+    img_piece[NP-QUEEN]  = cairo_image_surface_create_from_png("img/bq.png");
+    img_piece[NP-KING]   = cairo_image_surface_create_from_png("img/bk.png");
+    img_piece[NP+PAWN]   = cairo_image_surface_create_from_png("img/wp.png");
+    img_piece[NP+KNIGHT] = cairo_image_surface_create_from_png("img/wn.png");
+    img_piece[NP+BISHOP] = cairo_image_surface_create_from_png("img/wb.png");
+    img_piece[NP+ROOK]   = cairo_image_surface_create_from_png("img/wr.png");
+    img_piece[NP+QUEEN]  = cairo_image_surface_create_from_png("img/wq.png");
+    img_piece[NP+KING]   = cairo_image_surface_create_from_png("img/wk.png");
+    img_dark  = cairo_image_surface_create_from_png("img/black.png");
+    img_light = cairo_image_surface_create_from_png("img/white.png");
 }
 
 // adjudicates the result of moving a piece from (fx,fy) to (tx,ty)
@@ -587,69 +754,67 @@ static void perform_move(int fx, int fy, int tx, int ty) {
     save_edit();
 
     // push current board to the history stack so we can undo it later
-    hist = realloc(hist, ++nhist * sizeof *hist);
-    hist[nhist-1] = malloc(sizeof pieces);
-    memcpy(hist[nhist-1], pieces, sizeof pieces);
-
-    // do the move and update relevant states
-    simulate_move(pieces, fx, fy, tx, ty);
-    if (nhist % 2) {
-        if (cwk || (fy == 7 && (fx == 4 || fx == 7))) ++cwk;
-        if (cwq || (fy == 7 && (fx == 4 || fx == 0))) ++cwq;
-    } else {
-        if (cbk || (fy == 0 && (fx == 4 || fx == 7))) ++cbk;
-        if (cbq || (fy == 0 && (fx == 4 || fx == 0))) ++cbq;
-    }
-    current_check = in_check(pieces, 1-nhist%2*2, -1, -1, -1, -1, 0);
-
-    // check to see if this move is in the db
-    struct move *prev = NULL;
-    for (struct move *m = cur_node->child; m; prev = m, m = m->next) {
-        if (m->from == SQ(fx, fy) && m->to == SQ(tx, ty)) {
-            cur_node = m;
-            update_moves();
-            return;
+    hist = realloc(hist, (pos.ply+1) * sizeof *hist);
+    hist[pos.ply] = malloc(sizeof pos.pieces);
+    memcpy(hist[pos.ply], pos.pieces, sizeof pos.pieces);
+
+    // do the move and update relevant states (which may have been worked out
+    // already, if the move is in the book; the move itself is cheap, and
+    // shows whether what was prepared still fits)
+    struct move *known = cur_node->child;
+    while (known && (known->from != SQ(fx, fy) || known->to != SQ(tx, ty))) known = known->next;
+    position_move(&pos, fx, fy, tx, ty);
+    struct prepared *ready = known ? use_prepared(known, &pos) : NULL;
+    current_check = ready ? ready->check : in_check(pos.pieces, position_color(&pos), -1, -1, -1, -1, 0);
+
+    // check to see if this move is in the db (looking a second time after
+    // merging, in case someone else has just added it)
+    for (int merged = 0; merged < 2; ++merged) {
+        if (merged) begin_change(cur_node);
+        for (struct move *m = cur_node->child; m; m = m->next) {
+            if (m->from == SQ(fx, fy) && m->to == SQ(tx, ty)) {
+                if (merged) end_change(0);
+                cur_node = m;
+                update_moves();
+                return;
+            }
         }
     }
 
     // if not, add it
     struct move *new_move = new_node();
-    new_move->parent = cur_node;
     new_move->from = SQ(fx, fy);
     new_move->to = SQ(tx, ty);
-    new_move->desc = calloc(1, 1);
-    if (prev) prev->next = new_move;
-    else cur_node->child = new_move;
+    db_add(cur_node, new_move);
 
     cur_node = new_move;
-    save_db();
+    end_change(1);
+    update_overview();
 
     // solicit a description in the sidebar
     update_moves();
-    request_edit(new_move, moves, 0);
+    if (moves) request_edit(new_move, moves, 0);
 }
 
 // this implements the global shortcut of right click to go back one ply
 static gboolean mouse_pressed(GtkWidget *widget, GdkEventButton *event, gpointer data) {
     (void)widget; (void)data;
 
-    if (event->type == GDK_BUTTON_PRESS && event->button == 3 && nhist) {
+    if (event->type == GDK_BUTTON_PRESS && event->button == 3 && pos.ply) {
         // save any description edit currently in progress, since we're
         // navigating away
         save_edit();
 
         // pop from stack
-        memcpy(pieces, hist[--nhist], sizeof pieces);
-        free(hist[nhist]);
+        position_undo(&pos, hist[pos.ply-1]);
+        free(hist[pos.ply]);
 
         // update our position in the database
         cur_node = cur_node->parent;
 
         hover_move = NULL;
         update_moves();
-        if (nhist % 2) { if (cbk) --cbk; if (cbq) --cbq; }
-        else { if (cwk) --cwk; if (cwq) --cwq; }
-        current_check = in_check(pieces, 1-nhist%2*2, -1, -1, -1, -1, 0);
+        current_check = in_check(pos.pieces, position_color(&pos), -1, -1, -1, -1, 0);
         redraw();
 
         return TRUE;
@@ -666,9 +831,16 @@ static gboolean board_pressed(GtkWidget *widget, GdkEventButton *event, gpointer
     if (event->type == GDK_BUTTON_PRESS && event->button == 1) {
         click_x = event->x / 64;
         click_y = event->y / 64;
-        if (click_x < 8 && click_y < 8 && pieces[click_x][click_y] * (nhist%2*2-1) < 0) {
-            clicked = pieces[click_x][click_y];
-            update_legal(legal, pieces, abs(clicked), signum(clicked), click_x, click_y, 1);
+        if (click_x < 8 && click_y < 8 && pos.pieces[click_x][click_y] * position_color(&pos) > 0) {
+            clicked = pos.pieces[click_x][click_y];
+            struct prepared *ready = use_prepared(cur_node, &pos);
+            if (ready) {
+                uint64_t targets = ready->legal[SQ(click_x, click_y)];
+                for (int i = 0; i < 64; ++i) legal[X(i)][Y(i)] = targets >> i & 1;
+            } else {
+                update_legal(legal, pos.pieces, abs(clicked), signum(clicked), click_x, click_y, 1,
+                        castle_rights(&pos, signum(clicked)));
+            }
             redraw();
         }
         return TRUE;
@@ -733,9 +905,9 @@ static gboolean draw_board(GtkWidget *widget, cairo_t *cr, gpointer data) {
             }
 
             // draw piece, if any
-            if (pieces[i][j] && !(clicked && click_x == i && click_y == j)) {
+            if (pos.pieces[i][j] && !(clicked && click_x == i && click_y == j)) {
                 // draw king in check if relevant
-                if (current_check && pieces[i][j] == (1-nhist%2*2)*KING) {
+                if (current_check && pos.pieces[i][j] == position_color(&pos)*KING) {
                     cairo_pattern_t *pat = cairo_pattern_create_radial(
                             i*64+32, j*64+32, 0, i*64+32, j*64+32, 32);
                     cairo_pattern_add_color_stop_rgba(pat, 0, 1, 0, 0, 1);
@@ -746,7 +918,7 @@ static gboolean draw_board(GtkWidget *widget, cairo_t *cr, gpointer data) {
                     cairo_pattern_destroy(pat);
                 }
 
-                cairo_set_source_surface(cr, img_piece[NP+pieces[i][j]], i*64, j*64);
+                cairo_set_source_surface(cr, img_piece[NP+pos.pieces[i][j]], i*64, j*64);
                 cairo_paint(cr);
             }
 
@@ -789,34 +961,84 @@ static gboolean draw_board(GtkWidget *widget, cairo_t *cr, gpointer data) {
     return FALSE;
 }
 
-static void initialize_pieces() {
-    for (int i = 0; i < 8; ++i) {
-        pieces[i][1] = -PAWN;
-        pieces[i][6] = +PAWN;
-    }
-
-    pieces[0][0] = pieces[7][0] = -ROOK;
-    pieces[0][7] = pieces[7][7] = +ROOK;
+// (saves replace the file whole, so it can be read without the lock; one
+// that lands in the middle shows up as a change of generation)
+static void* load_thread(void *arg) {
+    struct file_state *f = arg;
+    uint64_t gen = db_generation(db_path);
+    f->root = db_read(db_path, &f->damage);
+    f->gen = db_generation(db_path);
+    if (!f->damage && f->gen != gen) f->damage = "file changed while read";
+    return NULL;
+}
 
-    pieces[1][0] = pieces[6][0] = -KNIGHT;
-    pieces[1][7] = pieces[6][7] = +KNIGHT;
+// takes in what the loader read, on the main loop
+static gboolean loaded_db(gpointer data) {
+    (void)data;
+    pthread_join(loader, NULL);
+    loading = 0;
+    finish_saving();
+
+    // a file that can't be read is looked at again only once it changes,
+    // and one we have saved ourselves since (or read already) is of no use
+    if (loaded.damage || loaded.gen == db_gen) db_stat = loaded.st;
+    if (loaded.damage || loaded.gen == db_gen || db_gen != loading_from) {
+        free_later(loaded.root);
+        return G_SOURCE_REMOVE;
+    }
+    merge_in(loaded.root, NULL);
+    db_gen = loaded.gen;
+    db_stat = loaded.st;
+    return G_SOURCE_REMOVE;
+}
 
-    pieces[2][0] = pieces[5][0] = -BISHOP;
-    pieces[2][7] = pieces[5][7] = +BISHOP;
+static void* load_and_report(void *arg) {
+    load_thread(arg);
+    g_idle_add(loaded_db, NULL);
+    return NULL;
+}
 
-    pieces[3][0] = -QUEEN;
-    pieces[3][7] = +QUEEN;
+// looks for saves by other instances once a second (the file is only read
+// when it has been replaced or touched since we last saw it)
+static gboolean check_db(gpointer data) {
+    (void)data;
+    struct stat st;
+    if (stat(db_path, &st)) memset(&st, 0, sizeof st);
+    if (!loading && !saving && (st.st_ino != db_stat.st_ino ||
+            st.st_size != db_stat.st_size ||
+            st.st_mtim.tv_sec != db_stat.st_mtim.tv_sec ||
+            st.st_mtim.tv_nsec != db_stat.st_mtim.tv_nsec)) {
+        // the file is read on a thread, and only the merge (which is done
+        // bit by bit) happens here
+        loaded = (struct file_state){ .st = st };
+        loading_from = db_gen;
+        loading = 1;
+        if (pthread_create(&loader, NULL, load_and_report, &loaded)) {
+            loading = 0;
+            db_lock_fd = db_trylock(db_path);
+            if (db_lock_fd != -1 || errno != EAGAIN) {
+                merge_db(NULL);
+                end_change(0);
+            }
+        }
+    }
 
-    pieces[4][0] = -KING;
-    pieces[4][7] = +KING;
+    // the sidebar can't be rebuilt under a description being edited, so
+    // that waits until the edit is done
+    if (moves_stale && !edit_text) {
+        update_moves();
+        redraw();
+    }
+    return TRUE;
+}
 
+static void initialize_pieces() {
+    position_init(&pos);
     current_check = 0;
-    cwk = cwq = cbk = cbq = 0;
 }
 
-void atop_init(int *argc, char ***argv) {
-    gtk_init(argc, argv);
-
+// builds the window (without showing it) and loads everything it displays
+static GtkWidget* initialize_ui() {
     GtkBuilder *builder = gtk_builder_new();
     gtk_builder_add_from_file(builder, "src/builder.ui", NULL);
     GObject *win = gtk_builder_get_object(builder, "window");
@@ -850,12 +1072,308 @@ void atop_init(int *argc, char ***argv) {
     initialize_images();
     initialize_pieces();
 
+    initialize_overview(builder);
     moves = GTK_GRID(gtk_builder_get_object(builder, "moves"));
     gtk_grid_set_row_spacing(moves, 20);
     gtk_widget_set_size_request(GTK_WIDGET(gtk_builder_get_object(builder, "scroll")), 256, 512);
     update_moves();
+    update_overview();
+    g_timeout_add_seconds(1, check_db, NULL);
+    return GTK_WIDGET(win);
+}
 
-    gtk_widget_show_all(GTK_WIDGET(win));
-
+void atop_init(int *argc, char ***argv) {
+    gtk_init(argc, argv);
+    gtk_widget_show_all(initialize_ui());
     gtk_main();
+    finish_saving();
+}
+
+// atop uibench - replays a script of events through the same handlers the
+// window uses and reports how long each kind took, along with the time taken
+// to draw the board (into an image, so that it can be timed on its own)
+//
+// each line of the script is one of the following (coordinates are in pixels
+// on the board, and # starts a comment)
+//
+//     press X Y       left button down on the board
+//     move X Y        pointer moved over the board
+//     release         left button up
+//     drag MOVE       all three at once, picking up a piece and dropping it
+//                     elsewhere (like e2e4), in eight moves on the way
+//     hover N         pointer over the Nth move in the sidebar (from 0)
+//     pick N          click on the Nth move in the sidebar
+//     back            right click, going back a move
+//
+// the positions prepared while idle (see prepare_ahead) are prepared after
+// each event instead, and timed separately
+//
+// without a display, only the board is exercised (so run it under xvfb-run to
+// include the sidebar); moves not in the book are added to a copy of it
+
+#define UIBENCH_KINDS 8
+static const char *uibench_kinds[UIBENCH_KINDS] = {
+    "press", "move", "release", "hover", "pick", "back", "idle", "frame"
+};
+
+struct samples {
+    double *ms;
+    size_t n, cap;
+};
+
+static void add_sample(struct samples *s, double ms) {
+    if (s->n == s->cap) s->ms = realloc(s->ms, (s->cap = s->cap ? s->cap * 2 : 256) * sizeof *s->ms);
+    s->ms[s->n++] = ms;
+}
+
+static int by_ms(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(struct samples *s, double p) {
+    size_t i = ceil(p * s->n);
+    return s->ms[i ? i - 1 : 0];
+}
+
+// the event box of the nth move in the sidebar (below the tablebase verdict,
+// if there is one)
+static GtkWidget* sidebar_move(int n) {
+    GtkWidget *w;
+    for (int row = 0; (w = gtk_grid_get_child_at(moves, 0, row)); ++row) {
+        if (GTK_IS_EVENT_BOX(w) && !n--) return w;
+    }
+    return NULL;
+}
+
+static struct move* nth_child(int n) {
+    struct move *m = cur_node->child;
+    while (m && n--) m = m->next;
+    return m;
+}
+
+// runs one event from the script, returning which kind it was, or -1 if it
+// doesn't make sense
+static int uibench_event(const char *name, int a, int b) {
+    static GtkWidget *hovered;  // (cleared when the sidebar is rebuilt)
+    GdkEventButton button = { .type = GDK_BUTTON_PRESS, .button = 1, .x = a, .y = b };
+    GdkEventMotion motion = { .type = GDK_MOTION_NOTIFY, .x = a, .y = b };
+
+    if (!strcmp(name, "press")) {
+        board_pressed(NULL, &button, NULL);
+        return 0;
+    }
+    if (!strcmp(name, "move")) {
+        board_moved(NULL, &motion, NULL);
+        return 1;
+    }
+    if (!strcmp(name, "release")) {
+        button.type = GDK_BUTTON_RELEASE;
+        board_released(NULL, &button, NULL);
+        return 2;
+    }
+    if (!strcmp(name, "hover") || !strcmp(name, "pick")) {
+        struct move *m = nth_child(a);
+        if (!m) return -1;
+        GtkWidget *box = moves ? sidebar_move(a) : NULL;
+        if (hovered) {
+            g_object_remove_weak_pointer(G_OBJECT(hovered), (gpointer*)&hovered);
+            move_left(hovered, NULL, NULL);
+        } else hover_move = NULL;
+        hovered = NULL;
+
+        if (!strcmp(name, "pick")) {
+            move_clicked(box, &button, m);
+            return 4;
+        }
+        if (box) {
+            move_entered(hovered = box, NULL, m);
+            g_object_add_weak_pointer(G_OBJECT(box), (gpointer*)&hovered);
+        } else {
+            hover_move = m;
+            redraw();
+        }
+        return 3;
+    }
+    if (!strcmp(name, "back")) {
+        button.button = 3;
+        mouse_pressed(NULL, &button, NULL);
+        return 5;
+    }
+    return -1;
+}
+
+// the script as a list of events, with drags split up into their parts
+struct script_event {
+    char name[8];
+    int a, b;
+    int line;
+};
+
+static struct script_event* read_script(const char *path, size_t *n) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return NULL;
+    }
+
+    size_t cap = 64;
+    struct script_event *events = malloc(cap * sizeof *events);
+    char line[256];
+    *n = 0;
+    for (int lineno = 1; fgets(line, sizeof line, f); ++lineno) {
+        char *hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+        char name[16], arg[16];
+        int a = 0, b = 0, fields = sscanf(line, "%15s %15s %d", name, arg, &b);
+        if (fields < 1) continue;
+        if (*n + 10 > cap) events = realloc(events, (cap *= 2) * sizeof *events);
+
+        if (!strcmp(name, "drag") && fields == 2 && parse_move(arg) != -1) {
+            int mv = parse_move(arg);
+            int fx = X(FROM(mv))*64+32, fy = Y(FROM(mv))*64+32,
+                tx = X(TO(mv))*64+32, ty = Y(TO(mv))*64+32;
+            events[(*n)++] = (struct script_event){ "press", fx, fy, lineno };
+            for (int i = 1; i <= 8; ++i) {
+                events[(*n)++] = (struct script_event){ "move",
+                    fx + (tx - fx) * i / 8, fy + (ty - fy) * i / 8, lineno };
+            }
+            events[(*n)++] = (struct script_event){ "release", 0, 0, lineno };
+            continue;
+        }
+
+        if (fields >= 2) a = strtol(arg, NULL, 10);
+        int want = !strcmp(name, "back") || !strcmp(name, "release") ? 1 :
+            !strcmp(name, "hover") || !strcmp(name, "pick") ? 2 :
+            !strcmp(name, "press") || !strcmp(name, "move") ? 3 : 0;
+        if (fields != want) {
+            fprintf(stderr, "%s:%d: bad event\n", path, lineno);
+            fclose(f);
+            free(events);
+            return NULL;
+        }
+        struct script_event e = { "", a, b, lineno };
+        strcpy(e.name, name);
+        events[(*n)++] = e;
+    }
+    fclose(f);
+    return events;
+}
+
+static int copy_file(const char *from, const char *to) {
+    FILE *in = fopen(from, "rb"), *out = fopen(to, "wb");
+    char buf[65536];
+    size_t n;
+    int err = !in || !out;
+    while (!err && (n = fread(buf, 1, sizeof buf, in))) err = fwrite(buf, 1, n, out) != n;
+    if (in) fclose(in);
+    if (out) err |= fclose(out) != 0;
+    return err ? -1 : 0;
+}
+
+int cmd_uibench(int argc, char **argv) {
+    const char *book = "atop.db";
+    int times = 1, opt;
+    while ((opt = getopt(argc, argv, "d:n:")) != -1) {
+        switch (opt) {
+            case 'd': book = optarg; break;
+            case 'n': times = strtol(optarg, NULL, 10); break;
+            default: times = 0; break;
+        }
+    }
+    if (optind != argc - 1 || times < 1) {
+        fputs("usage: atop uibench [-d database] [-n times] SCRIPT\n", stderr);
+        return 1;
+    }
+
+    size_t nevents;
+    struct script_event *events = read_script(argv[optind], &nevents);
+    if (!events) return 1;
+
+    // the book is worked on in a copy, since the script may add moves to it
+    // (and the copy's lock file is made next to it)
+    char path[] = "/tmp/atop-uibench-XXXXXX.lock";
+    path[sizeof path - sizeof ".lock"] = '\0';
+    int fd = mkstemp(path);
+    if (fd != -1) close(fd);
+    if (fd == -1 || copy_file(book, path)) {
+        perror(book);
+        if (fd != -1) unlink(path);
+        free(events);
+        return 1;
+    }
+    db_path = path;
+
+    prepare_by_hand = 1;
+    int display = gtk_init_check(&argc, &argv);
+    if (display) gtk_widget_show_all(initialize_ui());
+    else {
+        fputs("atop uibench: no display, so only the board is exercised\n", stderr);
+        initialize_db();
+        initialize_images();
+        initialize_pieces();
+        update_moves();     // (which only prepares ahead without a sidebar)
+    }
+
+    cairo_surface_t *frame = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 512, 512);
+    struct samples samples[UIBENCH_KINDS] = {{0}}, all = {0};
+    int failed = 0;
+    for (int t = 0; t < times && !failed; ++t) {
+        for (size_t i = 0; i < nevents; ++i) {
+            // with a display, everything the event set off (such as laying out
+            // the sidebar) is counted as well
+            gint64 t0 = g_get_monotonic_time();
+            int kind = uibench_event(events[i].name, events[i].a, events[i].b);
+            if (display) while (gtk_events_pending()) gtk_main_iteration();
+            gint64 t1 = g_get_monotonic_time();
+            if (kind == -1) {
+                // (such as picking a move past the end of the list, which
+                // would leave the rest of the script measuring something else)
+                fprintf(stderr, "%s:%d: no move %d to %s\n", argv[optind],
+                        events[i].line, events[i].a, events[i].name);
+                failed = 1;
+                break;
+            }
+            add_sample(&samples[kind], (t1 - t0) / 1000.0);
+            add_sample(&all, (t1 - t0) / 1000.0);
+
+            if (frame_due) {
+                frame_due = 0;
+                cairo_t *cr = cairo_create(frame);
+                draw_board(NULL, cr, NULL);
+                cairo_destroy(cr);
+                cairo_surface_flush(frame);
+                add_sample(&samples[UIBENCH_KINDS-1], (g_get_monotonic_time() - t1) / 1000.0);
+            }
+
+            // then whatever would be prepared before the next event, all at
+            // once (so that this is the most an idle spell could take)
+            if (next_queued < nqueued) {
+                gint64 t2 = g_get_monotonic_time();
+                while (prepare_one());
+                add_sample(&samples[UIBENCH_KINDS-2], (g_get_monotonic_time() - t2) / 1000.0);
+            }
+        }
+    }
+
+    if (!failed) printf("%-8s %8s %10s %10s %10s\n", "event", "count", "p50 ms", "p99 ms", "max ms");
+    for (int k = 0; k <= UIBENCH_KINDS; ++k) {
+        // (all events together come last, after the frames)
+        struct samples *s = k < UIBENCH_KINDS ? &samples[k] : &all;
+        if (s->n && !failed) {
+            qsort(s->ms, s->n, sizeof *s->ms, by_ms);
+            printf("%-8s %8zu %10.3f %10.3f %10.3f\n", k < UIBENCH_KINDS ? uibench_kinds[k] : "all",
+                    s->n, percentile(s, 0.5), percentile(s, 0.99), s->ms[s->n-1]);
+        }
+        free(s->ms);
+    }
+    if (!failed) printf("prepared positions used for %zu of %zu lookups\n", prepared_hits, prepared_lookups);
+
+    cairo_surface_destroy(frame);
+    free(events);
+    finish_saving();
+    unlink(path);
+    strcat(path, ".lock");
+    unlink(path);
+    return failed;
 }
@@ -0,0 +1,246 @@
+/*
+ * atop - opening database for atomic chess
+ * Copyright (C) 2018  Keyboard Fire <andy@keyboardfire.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// atop bench - times loading and saving of database files, and checks how deep
+// a single line can get before the storage code falls over
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "cmd.h"
+#include "chess.h"
+#include "db.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// milliseconds on a monotonic clock
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static long peak_rss_kb() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+static long file_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) ? -1 : (long)st.st_size;
+}
+
+// walks the tree in preorder without recursion, so that it works at any depth
+static long count_nodes(struct move *root) {
+    long n = 0;
+    for (struct move *m = root->child; m; ) {
+        ++n;
+        if (m->child) { m = m->child; continue; }
+        while (m != root && !m->next) m = m->parent;
+        m = m == root ? NULL : m->next;
+    }
+    return n;
+}
+
+// checks the totals kept on each node (see struct move) against a recount
+// after loading, after changes of every kind all over the tree under again (a
+// copy of root), and after merging root back in to undo them; root is freed
+// in the process
+// returns what went wrong, or NULL
+static const char* check_edits(struct move *root, struct move *again) {
+    const char *wrong = db_check_totals(again) ? "totals off after loading" : NULL;
+
+    // every 61st node is changed (collected first, since some are removed)
+    size_t n = 0, cap = 1024;
+    struct move **picked = malloc(cap * sizeof *picked);
+    long i = 0;
+    for (struct move *m = again->child; m; ++i) {
+        if (i % 61 == 0) {
+            if (n == cap) picked = realloc(picked, (cap *= 2) * sizeof *picked);
+            picked[n++] = m;
+        }
+        if (m->child) { m = m->child; continue; }
+        while (m != again && !m->next) m = m->parent;
+        m = m == again ? NULL : m->next;
+    }
+    // (last first, so that a node is gone only after everything under it)
+    for (size_t j = n; j--; ) {
+        struct move *m = picked[j];
+        switch (j % 4) {
+            case 0: db_remove(m); break;
+            case 1: db_set_desc(m, *m->desc ? "" : "bench"); break;
+            case 2: db_add(m, new_node()); break;
+            case 3: db_add(m->parent, new_node()); break;
+        }
+    }
+    free(picked);
+    if (!wrong && db_check_totals(again)) wrong = "totals off after changes";
+
+    db_merge(again, root, NULL, 0);
+    if (!wrong && db_check_totals(again)) wrong = "totals off after merging";
+    return wrong;
+}
+
+// (run in a child process of its own, see bench_in_child, so that the peak
+// memory use is this file's alone)
+static int bench_file(const char *path) {
+    char *out = malloc(strlen(path) + sizeof ".bench");
+    sprintf(out, "%s.bench", path);
+
+    double t0 = now();
+    struct move *root = db_load(path);
+    double t1 = now();
+    long nodes = count_nodes(root);
+    double t2 = now();
+    int err = db_save(root, out);
+    double t3 = now();
+    long rss = peak_rss_kb();   // (taken before loading the copy, below)
+
+    long size = file_size(path), saved = file_size(out);
+    struct move *again = db_load(out);
+    long reloaded = count_nodes(again);
+    const char *wrong = check_edits(root, again);
+    db_free(again);
+    unlink(out);
+    free(out);
+    if (err) {
+        perror(path);
+        return 1;
+    }
+
+    printf("%s: %ld nodes, %ld bytes (%ld when saved), load %.1f ms, save %.1f ms, peak rss %.1f MiB\n",
+            path, nodes, size, saved, t1 - t0, t3 - t2, rss / 1024.0);
+    if (reloaded != nodes) {
+        fprintf(stderr, "atop bench: %s had %ld nodes when saved again\n", path, reloaded);
+        return 1;
+    }
+    if (wrong) {
+        fprintf(stderr, "atop bench: %s: %s\n", path, wrong);
+        return 1;
+    }
+    return 0;
+}
+
+// runs bench_file in a child process, returning its exit status (or 1 if it
+// crashed)
+static int bench_in_child(const char *path) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) return bench_file(path);
+    if (pid == 0) {
+        int err = bench_file(path);
+        fflush(stdout);
+        _exit(err);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (WIFSIGNALED(status)) {
+        printf("%s: killed by signal %d\n", path, WTERMSIG(status));
+        return 1;
+    }
+    return WEXITSTATUS(status) != 0;
+}
+
+// builds a single line of the given number of plies (knights hopping back and
+// forth, so that it is legal however long it gets), then saves and loads it
+// in a child process so that a stack overflow can be reported instead of
+// taking the benchmark down with it
+static int bench_depth(long plies) {
+    char path[] = "/tmp/atop-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        static const int hops[4][2] = {
+            { SQ(6,7), SQ(5,5) }, { SQ(6,0), SQ(5,2) },
+            { SQ(5,5), SQ(6,7) }, { SQ(5,2), SQ(6,0) }
+        };
+        struct move *root = new_node(), *cur = root;
+        for (long i = 0; i < plies; ++i) {
+            struct move *m = new_node();
+            m->from = hops[i%4][0];
+            m->to = hops[i%4][1];
+            m->parent = cur;
+            cur->child = m;
+            cur = m;
+        }
+
+        double t0 = now();
+        if (db_save(root, path)) _exit(1);
+        double t1 = now();
+        root = db_load(path);
+        double t2 = now();
+        if (count_nodes(root) != plies) _exit(1);
+
+        printf("line of %ld plies: save %.1f ms, load %.1f ms\n", plies, t1 - t0, t2 - t1);
+        fflush(stdout);
+        _exit(0);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    unlink(path);
+    if (WIFSIGNALED(status)) {
+        printf("line of %ld plies: killed by signal %d\n", plies, WTERMSIG(status));
+        return 1;
+    }
+    if (WEXITSTATUS(status)) {
+        printf("line of %ld plies: did not survive a round trip\n", plies);
+        return 1;
+    }
+    return 0;
+}
+
+static void usage() {
+    fputs("usage: atop bench [-j threads] [-z level] FILE...\n"
+          "       atop bench -D plies\n", stderr);
+}
+
+int cmd_bench(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "D:j:z:")) != -1) {
+        switch (opt) {
+            case 'D': return bench_depth(strtol(optarg, NULL, 10));
+            case 'j': db_threads = strtol(optarg, NULL, 10); break;
+            case 'z': db_compression = strtol(optarg, NULL, 10); break;
+            default: usage(); return 1;
+        }
+    }
+    if (optind == argc) {
+        usage();
+        return 1;
+    }
+
+    int err = 0;
+    for (int i = optind; i < argc; ++i) err |= bench_in_child(argv[i]);
+    return err;
+}
@@ -0,0 +1,259 @@
+/*
+ * atop - opening database for atomic chess
+ * Copyright (C) 2018  Keyboard Fire <andy@keyboardfire.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "book.h"
+#include "chess.h"
+#include "cmd.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct book {
+    const unsigned char *data;
+    size_t len;
+    size_t n;
+};
+
+static void put_be(unsigned char *buf, uint64_t x, int bytes) {
+    while (bytes--) buf[bytes] = x & 0xff, x >>= 8;
+}
+
+static uint64_t get_be(const unsigned char *buf, int bytes) {
+    uint64_t x = 0;
+    for (int i = 0; i < bytes; ++i) x = x << 8 | buf[i];
+    return x;
+}
+
+// polyglot numbers ranks from white's side, while Y counts from the top
+static int encode_move(int move) {
+    return X(TO(move)) | (7 - Y(TO(move))) << 3 | X(FROM(move)) << 6 | (7 - Y(FROM(move))) << 9;
+}
+
+static int decode_move(int packed) {
+    return MOVE(SQ(packed >> 6 & 7, 7 - (packed >> 9 & 7)), SQ(packed & 7, 7 - (packed >> 3 & 7)));
+}
+
+// a record while the book is being built, before transpositions are merged
+struct record {
+    uint64_t key;
+    int move;
+    long parent;
+    unsigned long weight;
+};
+
+static int by_key_move(const void *a, const void *b) {
+    const struct record *x = a, *y = b;
+    if (x->key != y->key) return x->key < y->key ? -1 : 1;
+    return x->move - y->move;
+}
+
+static int by_key_weight(const void *a, const void *b) {
+    const struct record *x = a, *y = b;
+    if (x->key != y->key) return x->key < y->key ? -1 : 1;
+    if (x->weight != y->weight) return x->weight > y->weight ? -1 : 1;
+    return x->move - y->move;
+}
+
+struct export {
+    struct record *recs;
+    size_t nrec, caprec;
+    long *ridx;     // index of the record of the latest node at each depth
+    size_t capdepth;
+};
+
+static void add_record(struct move *node, struct position *pos, size_t depth, void *data) {
+    struct export *e = data;
+    if (e->nrec == e->caprec) e->recs = realloc(e->recs, (e->caprec *= 2) * sizeof *e->recs);
+    if (depth == e->capdepth) e->ridx = realloc(e->ridx, (e->capdepth *= 2) * sizeof *e->ridx);
+
+    e->recs[e->nrec].key = position_hash(pos);
+    e->recs[e->nrec].move = MOVE(node->from, node->to);
+    e->recs[e->nrec].parent = depth > 1 ? e->ridx[depth-1] : -1;
+    e->recs[e->nrec].weight = 1;
+    e->ridx[depth] = e->nrec++;
+}
+
+// writes a book with one record for every distinct position and move stored
+// under root, returning the number of records or -1 on failure
+int book_export(struct move *root, const char *path) {
+    struct export e = { malloc(1024 * sizeof *e.recs), 0, 1024, malloc(64 * sizeof *e.ridx), 64 };
+    db_walk(root, NULL, add_record, &e);
+    free(e.ridx);
+    struct record *recs = e.recs;
+    size_t nrec = e.nrec;
+
+    // parents always come before their children in preorder, so one backwards
+    // pass totals up the subtree sizes
+    for (size_t i = nrec; i-- > 0; ) {
+        if (recs[i].parent >= 0) recs[recs[i].parent].weight += recs[i].weight;
+    }
+
+    // merge moves that are stored under more than one move order
+    qsort(recs, nrec, sizeof *recs, by_key_move);
+    size_t n = 0;
+    for (size_t i = 0; i < nrec; ++i) {
+        if (n && recs[n-1].key == recs[i].key && recs[n-1].move == recs[i].move) {
+            recs[n-1].weight += recs[i].weight;
+        } else recs[n++] = recs[i];
+    }
+    qsort(recs, n, sizeof *recs, by_key_weight);
+
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        free(recs);
+        return -1;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        unsigned char buf[BOOK_RECORD] = {0};
+        put_be(buf, recs[i].key, 8);
+        put_be(buf + 8, encode_move(recs[i].move), 2);
+        put_be(buf + 10, recs[i].weight > 0xffff ? 0xffff : recs[i].weight, 2);
+        fwrite(buf, 1, BOOK_RECORD, f);
+    }
+    free(recs);
+    return fclose(f) ? -1 : (int)n;
+}
+
+// maps a book into memory, returning NULL if it can't be read
+struct book* book_open(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size % BOOK_RECORD) {
+        close(fd);
+        return NULL;
+    }
+
+    struct book *book = malloc(sizeof *book);
+    book->len = st.st_size;
+    book->n = book->len / BOOK_RECORD;
+    book->data = NULL;
+    if (book->len) {
+        void *data = mmap(NULL, book->len, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            free(book);
+            return NULL;
+        }
+        book->data = data;
+    }
+    close(fd);
+    return book;
+}
+
+void book_close(struct book *book) {
+    if (!book) return;
+    if (book->data) munmap((void*)book->data, book->len);
+    free(book);
+}
+
+// finds the records for a position by binary search, copying up to max of them
+// into entries and returning how many there are in total
+int book_probe(struct book *book, uint64_t key, struct book_entry *entries, int max) {
+    size_t lo = 0, hi = book->n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (get_be(book->data + mid * BOOK_RECORD, 8) < key) lo = mid + 1;
+        else hi = mid;
+    }
+
+    int n = 0;
+    for (; lo < book->n; ++lo, ++n) {
+        const unsigned char *rec = book->data + lo * BOOK_RECORD;
+        if (get_be(rec, 8) != key) break;
+        if (n < max) {
+            entries[n].key = key;
+            entries[n].move = decode_move(get_be(rec + 8, 2));
+            entries[n].weight = get_be(rec + 10, 2);
+        }
+    }
+    return n;
+}
+
+int cmd_export(int argc, char **argv) {
+    if (argc != 3) {
+        fputs("usage: atop export DATABASE BOOK\n", stderr);
+        return 1;
+    }
+
+    // (db_load makes do with an empty tree if it can't read the file, and
+    // with what it could read of a damaged one, neither of which will do here)
+    FILE *f = fopen(argv[1], "rb");
+    if (!f) {
+        perror(argv[1]);
+        return 1;
+    }
+    fclose(f);
+    struct move *root = db_load(argv[1]);
+    if (db_damage) {
+        fprintf(stderr, "atop export: %s: %s\n", argv[1], db_damage);
+        db_free(root);
+        return 1;
+    }
+
+    int n = book_export(root, argv[2]);
+    db_free(root);
+    if (n < 0) {
+        perror(argv[2]);
+        return 1;
+    }
+    fprintf(stderr, "atop export: wrote %d records\n", n);
+    return 0;
+}
+
+int cmd_probe(int argc, char **argv) {
+    if (argc < 2) {
+        fputs("usage: atop probe BOOK [MOVE...]\n", stderr);
+        return 1;
+    }
+
+    struct book *book = book_open(argv[1]);
+    if (!book) {
+        fprintf(stderr, "atop probe: can't read %s\n", argv[1]);
+        return 1;
+    }
+
+    struct position pos;
+    position_init(&pos);
+    for (int i = 2; i < argc; ++i) {
+        int m = parse_move(argv[i]);
+        if (m == -1) {
+            fprintf(stderr, "atop probe: bad move %s\n", argv[i]);
+            book_close(book);
+            return 1;
+        }
+        position_move(&pos, X(FROM(m)), Y(FROM(m)), X(TO(m)), Y(TO(m)));
+    }
+
+    struct book_entry entries[MAX_MOVES];
+    int n = book_probe(book, position_hash(&pos), entries, MAX_MOVES);
+    for (int i = 0; i < n && i < MAX_MOVES; ++i) {
+        char buf[5];
+        format_move(entries[i].move, buf);
+        printf("%s %d\n", buf, entries[i].weight);
+    }
+    book_close(book);
+    return 0;
+}
@@ -0,0 +1,53 @@
+/*
+ * atop - opening database for atomic chess
+ * Copyright (C) 2018  Keyboard Fire <andy@keyboardfire.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __BOOK_H__
+#define __BOOK_H__
+
+#include "db.h"
+
+#include <stdint.h>
+
+// books for engines, laid out like polyglot books: a flat file of 16 byte
+// records sorted by position hash (see position_hash), each holding
+//
+//     key     8 bytes, big endian
+//     move    2 bytes, big endian: to file, to rank, from file, from rank in
+//             three bits each from the least significant end
+//     weight  2 bytes, big endian: how many moves the database stores under
+//             this one, including itself
+//     learn   4 bytes, always zero
+//
+// records for the same position are ordered by decreasing weight
+// castling is stored as the king's two square move, not as king takes rook
+#define BOOK_RECORD 16
+
+struct book_entry {
+    uint64_t key;
+    int move;
+    int weight;
+};
+
+struct book;
+
+int book_export(struct move *root, const char *path);
+struct book* book_open(const char *path);
+void book_close(struct book *book);
+int book_probe(struct book *book, uint64_t key, struct book_entry *entries, int max);
+
+#endif
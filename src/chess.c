@@ -0,0 +1,331 @@
+/*
+ * atop - opening database for atomic chess
+ * Copyright (C) 2018  Keyboard Fire <andy@keyboardfire.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "chess.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void position_init(struct position *pos) {
+    memset(pos, 0, sizeof *pos);
+
+    for (int i = 0; i < 8; ++i) {
+        pos->pieces[i][1] = -PAWN;
+        pos->pieces[i][6] = +PAWN;
+    }
+
+    pos->pieces[0][0] = pos->pieces[7][0] = -ROOK;
+    pos->pieces[0][7] = pos->pieces[7][7] = +ROOK;
+
+    pos->pieces[1][0] = pos->pieces[6][0] = -KNIGHT;
+    pos->pieces[1][7] = pos->pieces[6][7] = +KNIGHT;
+
+    pos->pieces[2][0] = pos->pieces[5][0] = -BISHOP;
+    pos->pieces[2][7] = pos->pieces[5][7] = +BISHOP;
+
+    pos->pieces[3][0] = -QUEEN;
+    pos->pieces[3][7] = +QUEEN;
+
+    pos->pieces[4][0] = -KING;
+    pos->pieces[4][7] = +KING;
+}
+
+// 1 if white is to move, -1 if black is
+int position_color(struct position *pos) {
+    return 1 - pos->ply % 2 * 2;
+}
+
+int castle_rights(struct position *pos, int color) {
+    return (color == 1 ? !pos->cwk : !pos->cbk) * CASTLE_KING |
+           (color == 1 ? !pos->cwq : !pos->cbq) * CASTLE_QUEEN;
+}
+
+// does the move and updates castling state
+void position_move(struct position *pos, int fx, int fy, int tx, int ty) {
+    simulate_move(pos->pieces, fx, fy, tx, ty);
+    if (++pos->ply % 2) {
+        if (pos->cwk || (fy == 7 && (fx == 4 || fx == 7))) ++pos->cwk;
+        if (pos->cwq || (fy == 7 && (fx == 4 || fx == 0))) ++pos->cwq;
+    } else {
+        if (pos->cbk || (fy == 0 && (fx == 4 || fx == 7))) ++pos->cbk;
+        if (pos->cbq || (fy == 0 && (fx == 4 || fx == 0))) ++pos->cbq;
+    }
+}
+
+// takes back the last move, given the board as it was before that move
+void position_undo(struct position *pos, int board[8][8]) {
+    memcpy(pos->pieces, board, sizeof pos->pieces);
+    if (--pos->ply % 2) { if (pos->cbk) --pos->cbk; if (pos->cbq) --pos->cbq; }
+    else { if (pos->cwk) --pos->cwk; if (pos->cwq) --pos->cwq; }
+}
+
+void simulate_move(int board[8][8], int fx, int fy, int tx, int ty) {
+    if (board[tx][ty]) {
+        board[tx][ty] = 0;
+        if (tx-1 >= 0 && ty-1 >= 0 && abs(board[tx-1][ty-1]) != 1) board[tx-1][ty-1] = 0;
+        if (tx-1 >= 0              && abs(board[tx-1][ty])   != 1) board[tx-1][ty]   = 0;
+        if (tx-1 >= 0 && ty+1 <  8 && abs(board[tx-1][ty+1]) != 1) board[tx-1][ty+1] = 0;
+        if (             ty-1 >= 0 && abs(board[tx][ty-1])   != 1) board[tx][ty-1]   = 0;
+        if (             ty+1 <  8 && abs(board[tx][ty+1])   != 1) board[tx][ty+1]   = 0;
+        if (tx+1 <  8 && ty-1 >= 0 && abs(board[tx+1][ty-1]) != 1) board[tx+1][ty-1] = 0;
+        if (tx+1 <  8              && abs(board[tx+1][ty])   != 1) board[tx+1][ty]   = 0;
+        if (tx+1 <  8 && ty+1 <  8 && abs(board[tx+1][ty+1]) != 1) board[tx+1][ty+1] = 0;
+    } else board[tx][ty] = board[fx][fy];
+    board[fx][fy] = 0;
+
+    // resolve castling if it occurred
+    if (abs(board[tx][ty]) == KING && abs(tx - fx) == 2) {
+        int rx = tx > fx ? 7 : 0;
+        board[tx - signum(tx - fx)][ty] = board[rx][ty];
+        board[rx][ty] = 0;
+    }
+}
+
+int in_check(int board[8][8], int color, int fx, int fy, int tx, int ty, int mate) {
+    // copy the board and do the move
+    int new_board[8][8], new_legal[8][8];
+    memcpy(new_board, board, sizeof new_board);
+    if (fx != -1) simulate_move(new_board, fx, fy, tx, ty);
+
+    // locate the king
+    int kx, ky;
+    for (int i = 0; i < 8; ++i) {
+        for (int j = 0; j < 8; ++j) {
+            if (new_board[i][j] == color*KING) {
+                kx = i;
+                ky = j;
+                goto endfor;
+            }
+        }
+    }
+    return 2; // king was exploded - checkmate
+    endfor:{}
+
+    // connected kings are never in check
+    if (kx-1 >= 0 && ky-1 >= 0 && new_board[kx-1][ky-1] == -color*KING) return 0;
+    if (kx-1 >= 0              && new_board[kx-1][ky]   == -color*KING) return 0;
+    if (kx-1 >= 0 && ky+1 <  8 && new_board[kx-1][ky+1] == -color*KING) return 0;
+    if (             ky-1 >= 0 && new_board[kx][ky-1]   == -color*KING) return 0;
+    if (             ky+1 <  8 && new_board[kx][ky+1]   == -color*KING) return 0;
+    if (kx+1 <  8 && ky-1 >= 0 && new_board[kx+1][ky-1] == -color*KING) return 0;
+    if (kx+1 <  8              && new_board[kx+1][ky]   == -color*KING) return 0;
+    if (kx+1 <  8 && ky+1 <  8 && new_board[kx+1][ky+1] == -color*KING) return 0;
+
+    // check for direct threats
+    for (int i = 0; i < 8; ++i) {
+        for (int j = 0; j < 8; ++j) {
+            if (signum(new_board[i][j]) != -color) continue;
+            new_legal[kx][ky] = 0;
+            update_legal(new_legal, new_board, abs(new_board[i][j]), -color, i, j, 0, 0);
+            if (!new_legal[kx][ky]) continue;
+
+            // an enemy piece can legally take the king, so it's in check
+            // (castling is never a way out of check, hence no castling rights)
+            if (!mate) return 1;
+            for (int ii = 0; ii < 8; ++ii) {
+                for (int jj = 0; jj < 8; ++jj) {
+                    if (color * new_board[ii][jj] <= 0) continue;
+                    memset(new_legal, 0, sizeof new_legal);
+                    update_legal(new_legal, new_board, abs(new_board[ii][jj]), color, ii, jj, 1, 0);
+                    for (int iii = 0; iii < 8; ++iii) {
+                        for (int jjj = 0; jjj < 8; ++jjj) {
+                            if (new_legal[iii][jjj]) return 1;
+                        }
+                    }
+                }
+            }
+            return 2;
+        }
+    }
+
+    return 0;
+}
+
+// updates the legal array, which gives the positions to which the currently
+// held piece can move
+#define TRY(tx,ty) do { if (!(check && in_check(board, color, fx, fy, tx, ty, 0))) arr[tx][ty] = 1; } while (0)
+void update_legal(int arr[8][8], int board[8][8], int type, int color, int fx, int fy, int check, int castle) {
+    if (type == PAWN) {
+        // pawns never promote, so one on the last rank is simply stuck
+        if (fy-color < 0 || fy-color >= 8) return;
+        if (!board[fx][fy-color]) {
+            TRY(fx, fy-color);
+            if ((color == 1 ? fy == 6 : fy == 1) && !board[fx][fy-2*color]) {
+                TRY(fx, fy-2*color);
+            }
+        }
+        if (fx > 0 && color*board[fx-1][fy-color] < 0) TRY(fx-1, fy-color);
+        if (fx < 7 && color*board[fx+1][fy-color] < 0) TRY(fx+1, fy-color);
+        return;
+    }
+
+    if (type == KNIGHT) {
+        if (fx+1 <  8 && fy+2 <  8 && color*board[fx+1][fy+2] <= 0) TRY(fx+1, fy+2);
+        if (fx+1 <  8 && fy-2 >= 0 && color*board[fx+1][fy-2] <= 0) TRY(fx+1, fy-2);
+        if (fx+2 <  8 && fy+1 <  8 && color*board[fx+2][fy+1] <= 0) TRY(fx+2, fy+1);
+        if (fx+2 <  8 && fy-1 >= 0 && color*board[fx+2][fy-1] <= 0) TRY(fx+2, fy-1);
+        if (fx-1 >= 0 && fy+2 <  8 && color*board[fx-1][fy+2] <= 0) TRY(fx-1, fy+2);
+        if (fx-1 >= 0 && fy-2 >= 0 && color*board[fx-1][fy-2] <= 0) TRY(fx-1, fy-2);
+        if (fx-2 >= 0 && fy+1 <  8 && color*board[fx-2][fy+1] <= 0) TRY(fx-2, fy+1);
+        if (fx-2 >= 0 && fy-1 >= 0 && color*board[fx-2][fy-1] <= 0) TRY(fx-2, fy-1);
+        return;
+    }
+
+    if (type == KING) {
+        if (fx-1 >= 0 && fy-1 >= 0 && !board[fx-1][fy-1]) TRY(fx-1, fy-1);
+        if (fx-1 >= 0              && !board[fx-1][fy])   TRY(fx-1, fy);
+        if (fx-1 >= 0 && fy+1 <  8 && !board[fx-1][fy+1]) TRY(fx-1, fy+1);
+        if (             fy-1 >= 0 && !board[fx][fy-1])   TRY(fx,   fy-1);
+        if (             fy+1 <  8 && !board[fx][fy+1])   TRY(fx,   fy+1);
+        if (fx+1 <  8 && fy-1 >= 0 && !board[fx+1][fy-1]) TRY(fx+1, fy-1);
+        if (fx+1 <  8              && !board[fx+1][fy])   TRY(fx+1, fy);
+        if (fx+1 <  8 && fy+1 <  8 && !board[fx+1][fy+1]) TRY(fx+1, fy+1);
+        if (check && (castle & CASTLE_KING) &&
+                !in_check(board, color, -1, -1, -1, -1, 0) &&
+                !in_check(board, color, fx, fy, fx+1, fy, 0) &&
+                !in_check(board, color, fx, fy, fx+2, fy, 0)) arr[fx+2][fy] = 1;
+        if (check && (castle & CASTLE_QUEEN) &&
+                !in_check(board, color, -1, -1, -1, -1, 0) &&
+                !in_check(board, color, fx, fy, fx-1, fy, 0) &&
+                !in_check(board, color, fx, fy, fx-2, fy, 0) &&
+                !board[fx-3][fy]) arr[fx-2][fy] = 1;
+        return;
+    }
+
+    if (type == ROOK || type == QUEEN) {
+        for (int i = 1; fx+i < 8; ++i) {
+            if (color*board[fx+i][fy] <= 0) TRY(fx+i, fy);
+            if (board[fx+i][fy]) break;
+        }
+        for (int i = 1; fx-i >= 0; ++i) {
+            if (color*board[fx-i][fy] <= 0) TRY(fx-i, fy);
+            if (board[fx-i][fy]) break;
+        }
+        for (int i = 1; fy+i < 8; ++i) {
+            if (color*board[fx][fy+i] <= 0) TRY(fx, fy+i);
+            if (board[fx][fy+i]) break;
+        }
+        for (int i = 1; fy-i >= 0; ++i) {
+            if (color*board[fx][fy-i] <= 0) TRY(fx, fy-i);
+            if (board[fx][fy-i]) break;
+        }
+    }
+
+    if (type == BISHOP || type == QUEEN) {
+        for (int i = 1; fx+i < 8 && fy+i < 8; ++i) {
+            if (color*board[fx+i][fy+i] <= 0) TRY(fx+i, fy+i);
+            if (board[fx+i][fy+i]) break;
+        }
+        for (int i = 1; fx+i < 8 && fy-i >= 0; ++i) {
+            if (color*board[fx+i][fy-i] <= 0) TRY(fx+i, fy-i);
+            if (board[fx+i][fy-i]) break;
+        }
+        for (int i = 1; fx-i >= 0 && fy+i < 8; ++i) {
+            if (color*board[fx-i][fy+i] <= 0) TRY(fx-i, fy+i);
+            if (board[fx-i][fy+i]) break;
+        }
+        for (int i = 1; fx-i >= 0 && fy-i >= 0; ++i) {
+            if (color*board[fx-i][fy-i] <= 0) TRY(fx-i, fy-i);
+            if (board[fx-i][fy-i]) break;
+        }
+    }
+}
+
+// fills moves with every legal move for the side to move and returns how many
+// there are
+int generate_moves(struct position *pos, int moves[MAX_MOVES]) {
+    int color = position_color(pos), castle = castle_rights(pos, color), n = 0;
+    for (int i = 0; i < 8; ++i) {
+        for (int j = 0; j < 8; ++j) {
+            if (color * pos->pieces[i][j] <= 0) continue;
+            int arr[8][8] = {{0}};
+            update_legal(arr, pos->pieces, abs(pos->pieces[i][j]), color, i, j, 1, castle);
+            for (int ii = 0; ii < 8; ++ii) {
+                for (int jj = 0; jj < 8; ++jj) {
+                    if (arr[ii][jj] && n < MAX_MOVES) moves[n++] = MOVE(SQ(i, j), SQ(ii, jj));
+                }
+            }
+        }
+    }
+    return n;
+}
+
+// convert from and to coords into algebraic notation
+char* algebraic(struct position *pos, int fx, int fy, int tx, int ty) {
+    char *buf = malloc(10);
+    int idx = 0;
+    int type = abs(pos->pieces[fx][fy]);
+    if (type == KING && abs(tx - fx) == 2) {
+        buf[idx++] = 'O'; buf[idx++] = '-'; buf[idx++] = 'O';
+        if (tx < fx) { buf[idx++] = '-'; buf[idx++] = 'O'; }
+    } else {
+        if (type == PAWN) {
+            if (pos->pieces[tx][ty]) buf[idx++] = 'a' + fx;
+        } else buf[idx++] = "  NBRQK"[type];
+        if (pos->pieces[tx][ty]) buf[idx++] = 'x';
+        buf[idx++] = 'a' + tx;
+        buf[idx++] = '8' - ty;
+    }
+    switch (in_check(pos->pieces, -position_color(pos), fx, fy, tx, ty, 1)) {
+        case 1: buf[idx++] = '+'; break;
+        case 2: buf[idx++] = '#'; break;
+    }
+    buf[idx] = '\0';
+    return buf;
+}
+
+// zobrist keys are derived from their index on the fly rather than kept in a
+// table, so hashing needs no initialization and is safe from any thread
+static uint64_t zobrist(uint64_t idx) {
+    uint64_t z = (idx + 1) * 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// a hash of everything that determines which moves are legal
+uint64_t position_hash(struct position *pos) {
+    uint64_t h = 0;
+    for (int i = 0; i < 8; ++i) {
+        for (int j = 0; j < 8; ++j) {
+            if (pos->pieces[i][j]) h ^= zobrist((NP + pos->pieces[i][j]) * 64 + SQ(i, j));
+        }
+    }
+    if (!pos->cwk) h ^= zobrist((NP*2+1) * 64 + 0);
+    if (!pos->cwq) h ^= zobrist((NP*2+1) * 64 + 1);
+    if (!pos->cbk) h ^= zobrist((NP*2+1) * 64 + 2);
+    if (!pos->cbq) h ^= zobrist((NP*2+1) * 64 + 3);
+    if (position_color(pos) == -1) h ^= zobrist((NP*2+1) * 64 + 4);
+    return h;
+}
+
+// converts between moves and coordinate notation (e.g. e2e4)
+int parse_move(const char *str) {
+    if (strlen(str) != 4 ||
+            str[0] < 'a' || str[0] > 'h' || str[1] < '1' || str[1] > '8' ||
+            str[2] < 'a' || str[2] > 'h' || str[3] < '1' || str[3] > '8') return -1;
+    return MOVE(SQ(str[0] - 'a', '8' - str[1]), SQ(str[2] - 'a', '8' - str[3]));
+}
+
+void format_move(int move, char buf[5]) {
+    buf[0] = 'a' + X(FROM(move));
+    buf[1] = '8' - Y(FROM(move));
+    buf[2] = 'a' + X(TO(move));
+    buf[3] = '8' - Y(TO(move));
+    buf[4] = '\0';
+}
@@ -0,0 +1,75 @@
+/*
+ * atop - opening database for atomic chess
+ * Copyright (C) 2018  Keyboard Fire <andy@keyboardfire.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CHESS_H__
+#define __CHESS_H__
+
+#include <stdint.h>
+
+#define signum(x) (((x) > 0) - ((x) < 0))
+
+#define PAWN   1
+#define KNIGHT 2
+#define BISHOP 3
+#define ROOK   4
+#define QUEEN  5
+#define KING   6
+#define NP     KING
+
+// converting coordinates between one and two dimensional representations
+#define SQ(x,y) ((x)*8+(y))
+#define X(sq) ((sq)/8)
+#define Y(sq) ((sq)%8)
+
+// a move packed into a single int, as returned by generate_moves
+#define MOVE(from,to) ((from)*64+(to))
+#define FROM(m) ((m)/64)
+#define TO(m) ((m)%64)
+#define MAX_MOVES 256
+
+// castling rights passed to update_legal
+#define CASTLE_KING  1
+#define CASTLE_QUEEN 2
+
+// a complete game state
+// the castling fields count how many of that side's moves ago the king or the
+// corresponding rook first moved, so that they can be decremented on undo
+// (zero means castling that way is still allowed)
+struct position {
+    int pieces[8][8];
+    int cwk, cwq, cbk, cbq;
+    int ply;
+};
+
+void position_init(struct position *pos);
+int position_color(struct position *pos);
+int castle_rights(struct position *pos, int color);
+void position_move(struct position *pos, int fx, int fy, int tx, int ty);
+void position_undo(struct position *pos, int board[8][8]);
+
+void simulate_move(int board[8][8], int fx, int fy, int tx, int ty);
+int in_check(int board[8][8], int color, int fx, int fy, int tx, int ty, int mate);
+void update_legal(int arr[8][8], int board[8][8], int type, int color, int fx, int fy, int check, int castle);
+int generate_moves(struct position *pos, int moves[MAX_MOVES]);
+char* algebraic(struct position *pos, int fx, int fy, int tx, int ty);
+
+uint64_t position_hash(struct position *pos);
+int parse_move(const char *str);
+void format_move(int move, char buf[5]);
+
+#endif
@@ -0,0 +1,34 @@
+/*
+ * atop - opening database for atomic chess
+ * Copyright (C) 2018  Keyboard Fire <andy@keyboardfire.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CMD_H__
+#define __CMD_H__
+
+// subcommands that run from the command line instead of opening the window
+// (argv[0] is the name of the subcommand, and the return value is the exit
+// status)
+int cmd_gen(int argc, char **argv);
+int cmd_bench(int argc, char **argv);
+int cmd_export(int argc, char **argv);
+int cmd_probe(int argc, char **argv);
+int cmd_serve(int argc, char **argv);
+int cmd_tb(int argc, char **argv);
+int cmd_verify(int argc, char **argv);
+int cmd_uibench(int argc, char **argv);
+
+#endif
@@ -0,0 +1,1127 @@
+/*
+ * atop - opening database for atomic chess
+ * Copyright (C) 2018  Keyboard Fire <andy@keyboardfire.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "db.h"
+#include "chess.h"
+#include "intern.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+int db_compression = Z_BEST_SPEED;
+int db_threads = 0;
+const char *db_damage;
+
+// nodes are handed out from blocks rather than allocated one at a time, which
+// is faster and saves malloc's overhead on every node; freed nodes are kept on
+// a list for reuse (the blocks themselves are never freed)
+// each loading thread has an arena of its own, and new_node uses the shared
+// one
+#define NODE_BLOCK 4096
+struct arena {
+    struct move *next, *end;            // the rest of the latest block
+    struct move *reuse[NODE_BLOCK];     // freed nodes taken from the list
+    size_t nreuse;
+};
+static struct arena shared_arena;
+static struct move **free_nodes;
+static size_t nfree, capfree;
+static pthread_mutex_t free_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// (must be called with free_lock held)
+static void push_free(struct move *node) {
+    if (nfree == capfree) {
+        capfree = capfree ? capfree * 2 : NODE_BLOCK;
+        free_nodes = realloc(free_nodes, capfree * sizeof *free_nodes);
+    }
+    free_nodes[nfree++] = node;
+}
+
+static struct move* alloc_node(struct arena *a) {
+    if (a->nreuse) return a->reuse[--a->nreuse];
+    if (a->next != a->end) return a->next++;
+
+    // take a batch of freed nodes if there are any, or else a new block
+    pthread_mutex_lock(&free_lock);
+    size_t n = nfree < NODE_BLOCK ? nfree : NODE_BLOCK;
+    nfree -= n;
+    if (n) memcpy(a->reuse, free_nodes + nfree, n * sizeof *free_nodes);
+    pthread_mutex_unlock(&free_lock);
+    a->nreuse = n;
+    if (n) return a->reuse[--a->nreuse];
+
+    a->next = malloc(NODE_BLOCK * sizeof *a->next);
+    a->end = a->next + NODE_BLOCK;
+    return a->next++;
+}
+
+// gives back whatever an arena hasn't handed out
+static void release_arena(struct arena *a) {
+    pthread_mutex_lock(&free_lock);
+    while (a->nreuse) push_free(a->reuse[--a->nreuse]);
+    while (a->next != a->end) push_free(a->next++);
+    pthread_mutex_unlock(&free_lock);
+}
+
+static struct move* make_node(struct arena *a) {
+    // the empty description is kept around for good, since most new nodes
+    // start out with it
+    static const char *empty;
+    if (!empty) empty = intern("");
+
+    struct move *node = alloc_node(a);
+    node->desc = intern_ref(empty, 1);
+    node->next = NULL;
+    node->child = NULL;
+    node->parent = NULL;
+    node->pinned = 0;
+    node->below = node->below_empty = node->below_depth = 0;
+    return node;
+}
+
+struct move* new_node() {
+    return make_node(&shared_arena);
+}
+
+// adds the moves from node down to the totals of its ancestors, or takes
+// them away again (after node has been unlinked from parent)
+static void count_in(struct move *node) {
+    uint32_t below = 1 + node->below, empty = !*node->desc + node->below_empty;
+    uint32_t depth = 1 + node->below_depth;
+    for (struct move *p = node->parent; p; p = p->parent, ++depth) {
+        p->below += below;
+        p->below_empty += empty;
+        if (p->below_depth < depth) p->below_depth = depth;
+    }
+}
+
+static void count_out(struct move *parent, struct move *node) {
+    uint32_t below = 1 + node->below, empty = !*node->desc + node->below_empty;
+    int deepest = 1;    // whether the longest line still has to be found again
+    for (struct move *p = parent; p; p = p->parent) {
+        p->below -= below;
+        p->below_empty -= empty;
+        if (!deepest) continue;
+        uint32_t depth = 0;
+        for (struct move *c = p->child; c; c = c->next) {
+            if (depth < 1 + c->below_depth) depth = 1 + c->below_depth;
+        }
+        deepest = depth != p->below_depth;
+        p->below_depth = depth;
+    }
+}
+
+void db_set_desc(struct move *node, const char *desc) {
+    const char *old = node->desc;
+    node->desc = intern(desc);
+    if (!*old != !*node->desc) {
+        for (struct move *p = node->parent; p; p = p->parent) {
+            if (*old) ++p->below_empty;
+            else --p->below_empty;
+        }
+    }
+    unintern(old);
+}
+
+// varints are 7 bits at a time, least significant first, with the top bit
+// set on all but the last byte
+static void put_varint(FILE *f, uint64_t x) {
+    while (x >= 0x80) {
+        fputc((x & 0x7f) | 0x80, f);
+        x >>= 7;
+    }
+    fputc(x, f);
+}
+
+// returns the position after the varint, or NULL if it runs past end
+static const unsigned char* get_varint(const unsigned char *p, const unsigned char *end, uint64_t *x) {
+    *x = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        *x |= (uint64_t)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80)) return p;
+    }
+    return NULL;
+}
+
+static unsigned char* read_file(const char *path, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+    struct stat st;
+    if (fstat(fileno(f), &st)) {
+        fclose(f);
+        return NULL;
+    }
+    unsigned char *data = malloc(st.st_size ? st.st_size : 1);
+    *len = fread(data, 1, st.st_size, f);
+    fclose(f);
+    return data;
+}
+
+// how many threads to spread this many tasks over
+static long thread_count(size_t tasks) {
+    long threads = db_threads > 0 ? db_threads : sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > (long)tasks) threads = tasks;
+    return threads < 1 ? 1 : threads;
+}
+
+// runs fn on each of the threads elements (size bytes apart) of args, the
+// first on this thread
+static void run_threads(void* (*fn)(void*), void *args, size_t size, long threads) {
+    pthread_t *tids = malloc(threads * sizeof *tids);
+    for (long i = 1; i < threads; ++i) pthread_create(&tids[i], NULL, fn, (char*)args + i * size);
+    fn(args);
+    for (long i = 1; i < threads; ++i) pthread_join(tids[i], NULL);
+    free(tids);
+}
+
+// a block of descriptions, and the interned descriptions in it once decoded
+struct block {
+    const unsigned char *data;
+    uint64_t rawlen, stored;
+    const char **strs;
+    size_t n;
+    int unterminated;   // whether the last description is missing its NUL
+};
+
+static int decode_block(struct block *b) {
+    const unsigned char *raw = b->data;
+    unsigned char *buf = NULL;
+    if (b->stored != b->rawlen) {
+        // (zlib can't do better than about 1000 to 1)
+        if (b->rawlen > 1100 * b->stored + 64) return 0;
+        uLongf len = b->rawlen;
+        raw = buf = malloc(b->rawlen ? b->rawlen : 1);
+        if (uncompress(buf, &len, b->data, b->stored) != Z_OK || len != b->rawlen) {
+            free(buf);
+            return 0;
+        }
+    }
+
+    size_t cap = 64;
+    b->strs = malloc(cap * sizeof *b->strs);
+    for (size_t i = 0; i < b->rawlen; ) {
+        const unsigned char *nul = memchr(raw + i, 0, b->rawlen - i);
+        size_t len = nul ? (size_t)(nul - raw) - i : b->rawlen - i;
+        b->unterminated = !nul;
+        if (b->n == cap) b->strs = realloc(b->strs, (cap *= 2) * sizeof *b->strs);
+        b->strs[b->n++] = intern_len((const char*)raw + i, len);
+        i += len + 1;
+    }
+    free(buf);
+    return 1;
+}
+
+struct block_loader {
+    struct block *blocks;
+    size_t nblocks, next;
+    pthread_mutex_t lock;
+    int failed;
+};
+
+static void* decode_thread(void *arg) {
+    struct block_loader *l = *(struct block_loader**)arg;
+    for (;;) {
+        pthread_mutex_lock(&l->lock);
+        size_t i = l->next++;
+        pthread_mutex_unlock(&l->lock);
+        if (i >= l->nblocks) return NULL;
+        if (!decode_block(&l->blocks[i])) l->failed = 1;
+    }
+}
+
+static const unsigned char* read_block_header(const unsigned char *p, const unsigned char *end,
+        struct block *b) {
+    if (!(p = get_varint(p, end, &b->rawlen)) || !(p = get_varint(p, end, &b->stored)) ||
+            b->stored > (uint64_t)(end - p)) return NULL;
+    b->data = p;
+    b->strs = NULL;
+    b->n = 0;
+    b->unterminated = 0;
+    return p + b->stored;
+}
+
+// reads the table of descriptions into strs, returning the position after it,
+// or NULL if it's damaged (a description without its NUL is kept, but sets
+// unterminated)
+// from version 3 on, the number of blocks is known up front, so that they can
+// be decoded on several threads
+static const unsigned char* read_strings(const unsigned char *p, const unsigned char *end,
+        int version, const char ***strs, size_t *nstrs, int *unterminated) {
+    uint64_t n, nblocks = 0;
+    if (!(p = get_varint(p, end, &n))) return NULL;
+    if (version >= 3 && (!(p = get_varint(p, end, &nblocks)) || nblocks > (uint64_t)(end - p))) return NULL;
+
+    size_t cap = version >= 3 ? nblocks : 16, count = 0, total = 0;
+    struct block *blocks = malloc((cap ? cap : 1) * sizeof *blocks);
+    int ok = 1;
+    if (version >= 3) {
+        while (count < nblocks && (p = read_block_header(p, end, &blocks[count]))) ++count;
+        if ((ok = count == nblocks)) {
+            struct block_loader l = { blocks, count, 0, PTHREAD_MUTEX_INITIALIZER, 0 };
+            long threads = thread_count(count);
+            struct block_loader **args = malloc(threads * sizeof *args);
+            for (long i = 0; i < threads; ++i) args[i] = &l;
+            run_threads(decode_thread, args, sizeof *args, threads);
+            free(args);
+            ok = !l.failed;
+        }
+        for (size_t i = 0; i < count; ++i) total += blocks[i].n;
+    } else {
+        // the blocks only end once there are enough descriptions
+        while (total < n && ok) {
+            if (count == cap) blocks = realloc(blocks, (cap *= 2) * sizeof *blocks);
+            if (!(p = read_block_header(p, end, &blocks[count]))) break;
+            ok = decode_block(&blocks[count]);
+            total += blocks[count++].n;
+        }
+        ok = ok && p;
+    }
+
+    *strs = malloc((total ? total : 1) * sizeof **strs);
+    *nstrs = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (blocks[i].n) memcpy(*strs + *nstrs, blocks[i].strs, blocks[i].n * sizeof **strs);
+        *unterminated |= blocks[i].unterminated;
+        *nstrs += blocks[i].n;
+        free(blocks[i].strs);
+    }
+    free(blocks);
+    return ok && total == n ? p : NULL;
+}
+
+// the state of parsing a part of the tree
+struct parser {
+    const unsigned char *p, *end;
+    int version;
+    const char **strs;          // the table of descriptions (version 2 on),
+    size_t nstrs;               // and how often each has been used, since
+    uint32_t *uses;             // references to them are added at the end
+    struct arena *arena;
+    struct move *last;          // the node parsed last
+    const char *damage;         // what was wrong with the data, if anything
+};
+
+// notes the first thing found wrong with the data, returning 0
+static int damaged(struct parser *ps, const char *what) {
+    if (!ps->damage) ps->damage = what;
+    return 0;
+}
+
+// a subtree left for the loading threads, whose node has been parsed but not
+// the part of the file between start and end with its children
+struct task {
+    struct move *node;
+    const unsigned char *start, *end;
+};
+
+// the spine of an indexed tree is parsed down to this depth, with every
+// subtree there made into a task instead, its length read from lens
+struct split {
+    size_t depth;
+    const unsigned char *lens, *lens_end;
+    struct task *tasks;
+    size_t ntasks, cap;
+};
+
+// (desc is left NULL if the record is damaged)
+static int parse_record(struct parser *ps, struct move *node) {
+    node->desc = NULL;
+    if (ps->end - ps->p < 2) return damaged(ps, "file ends in the middle of a move");
+    node->from = *ps->p++;
+    node->to = *ps->p++;
+
+    if (ps->version >= 2) {
+        uint64_t i;
+        const unsigned char *next = get_varint(ps->p, ps->end, &i);
+        if (!next || i >= ps->nstrs) return damaged(ps, "description index out of range");
+        ps->p = next;
+        node->desc = ps->strs[i];
+        ++ps->uses[i];
+    } else {
+        // (older files can only be parsed by one thread, as this interns)
+        const unsigned char *nul = memchr(ps->p, 0, ps->end - ps->p);
+        if (!nul) return damaged(ps, "unterminated description");
+        node->desc = intern_len((const char*)ps->p, nul - ps->p);
+        ps->p = nul + 1;
+    }
+    return 1;
+}
+
+// adds node, once everything under it is done, to the totals of its parent
+static void add_to_parent(struct move *node) {
+    struct move *p = node->parent;
+    p->below += 1 + node->below;
+    p->below_empty += !*node->desc + node->below_empty;
+    if (p->below_depth < 1 + node->below_depth) p->below_depth = 1 + node->below_depth;
+}
+
+// parses the children of top, up to and including the FF that ends top,
+// returning 0 if the data is damaged
+// the totals of each node are added up as it's finished, except for those
+// made into tasks, which are left to the caller
+static int parse_nodes(struct parser *ps, struct move *top, struct split *split) {
+    struct move *cur = top;
+    int child = 1;      // whether the next node is a child of cur or its sibling
+    size_t depth = 0;   // of cur, below top
+    while (cur != top || child) {
+        if (ps->p == ps->end) return damaged(ps, "file ends before the tree does");
+
+        // waiting for a new node - if we see FF, we go up one level
+        if (*ps->p == 0xff) {
+            ++ps->p;
+            if (child) child = 0;
+            else cur = cur->parent, --depth;
+            if (cur != top) add_to_parent(cur);
+            continue;
+        }
+
+        struct move *new = alloc_node(ps->arena);
+        new->child = new->next = NULL;
+        new->pinned = 0;
+        new->below = new->below_empty = new->below_depth = 0;
+        if (child) new->parent = cur, cur->child = new, ++depth;
+        else new->parent = cur->parent, cur->next = new;
+        cur = ps->last = new;
+        child = 1;
+        if (!parse_record(ps, new)) return 0;
+
+        if (split && depth == split->depth) {
+            uint64_t len;
+            if (!(split->lens = get_varint(split->lens, split->lens_end, &len)) ||
+                    len > (uint64_t)(ps->end - ps->p)) return 0;
+            if (split->ntasks == split->cap) {
+                split->cap = split->cap ? split->cap * 2 : 1024;
+                split->tasks = realloc(split->tasks, split->cap * sizeof *split->tasks);
+            }
+            split->tasks[split->ntasks++] = (struct task){ new, ps->p, ps->p + len };
+            ps->p += len;
+            child = 0;
+        }
+    }
+    return 1;
+}
+
+// the state shared by the loading threads
+struct loader {
+    struct task *tasks;
+    size_t ntasks, next;
+    pthread_mutex_t lock;
+    int failed;
+};
+
+struct worker {
+    struct loader *l;
+    struct parser ps;
+};
+
+static void* load_thread(void *arg) {
+    struct worker *w = arg;
+    for (;;) {
+        pthread_mutex_lock(&w->l->lock);
+        size_t i = w->l->next++;
+        pthread_mutex_unlock(&w->l->lock);
+        if (i >= w->l->ntasks) break;
+
+        struct task *t = &w->l->tasks[i];
+        w->ps.p = t->start;
+        w->ps.end = t->end;
+        if (!parse_nodes(&w->ps, t->node, NULL) || w->ps.p != t->end) {
+            // a node that failed to parse is only half there
+            if (w->ps.last && !w->ps.last->desc) {
+                w->ps.last->desc = w->ps.strs[0];
+                ++w->ps.uses[0];
+            }
+            w->l->failed = 1;
+        }
+    }
+    release_arena(w->ps.arena);
+    return NULL;
+}
+
+// largest first, so that no thread is left with a big one at the end
+static int by_length(const void *a, const void *b) {
+    const struct task *x = a, *y = b;
+    if (x->end - x->start != y->end - y->start) return x->end - x->start > y->end - y->start ? -1 : 1;
+    return 0;
+}
+
+// loads an indexed tree from p to end, with its index from lens to lens_end,
+// spreading its subtrees over threads, and returning 0 if it's damaged (in
+// which case everything parsed is still linked under root)
+static int load_parallel(struct parser *ps, struct move *root,
+        const unsigned char *lens, const unsigned char *lens_end) {
+    uint64_t depth, n;
+    if (!(lens = get_varint(lens, lens_end, &depth)) || !(lens = get_varint(lens, lens_end, &n))) return 0;
+    struct split split = { depth, lens, lens_end, NULL, 0, 0 };
+    int ok = parse_nodes(ps, root, &split);
+
+    // the spine's thread is one of the workers
+    struct loader l = { split.tasks, ok ? split.ntasks : 0, 0, PTHREAD_MUTEX_INITIALIZER, 0 };
+    qsort(l.tasks, l.ntasks, sizeof *l.tasks, by_length);
+    long threads = thread_count(l.ntasks);
+    struct worker *args = malloc(threads * sizeof *args);
+    for (long i = 0; i < threads; ++i) {
+        args[i].l = &l;
+        args[i].ps = *ps;
+        if (i) {
+            args[i].ps.arena = malloc(sizeof *args[i].ps.arena);
+            args[i].ps.arena->next = args[i].ps.arena->end = NULL;
+            args[i].ps.arena->nreuse = 0;
+            args[i].ps.uses = calloc(ps->nstrs, sizeof *ps->uses);
+        }
+    }
+    run_threads(load_thread, args, sizeof *args, threads);
+    for (long i = 1; i < threads; ++i) {
+        for (size_t j = 0; j < ps->nstrs; ++j) ps->uses[j] += args[i].ps.uses[j];
+        free(args[i].ps.uses);
+        free(args[i].ps.arena);
+    }
+    free(args);
+
+    ok = ok && !l.failed && split.ntasks == n && split.lens == lens_end;
+    for (size_t i = 0; ok && i < split.ntasks; ++i) count_in(split.tasks[i].node);
+    free(split.tasks);
+    return ok;
+}
+
+// works out the totals of every node under root from scratch, which is only
+// needed if the file was damaged (otherwise they're added up while parsing)
+static void count_tree(struct move *root) {
+    root->below = root->below_empty = root->below_depth = 0;
+    for (struct move *m = root->child; m; ) {
+        m->below = m->below_empty = m->below_depth = 0;
+        if (m->child) {
+            m = m->child;
+            continue;
+        }
+        for (;;) {
+            add_to_parent(m);
+            if (m->next) {
+                m = m->next;
+                break;
+            }
+            if ((m = m->parent) == root) {
+                m = NULL;
+                break;
+            }
+        }
+    }
+}
+
+// the following function reads a database file and returns its root node
+// (a file that can't be read yields an empty database, and a damaged one as
+// much of it as could be read, with damage saying what was wrong, or NULL)
+// trees saved with an index are split up among db_threads threads
+// nodes come from an arena of the call's own, so that this can run on another
+// thread while the rest of the program goes on using new_node
+struct move* db_read(const char *path, const char **damage) {
+    struct arena *arena = malloc(sizeof *arena);
+    arena->next = arena->end = NULL;
+    arena->nreuse = 0;
+
+    // initialize root node (from and to values are irrelevant)
+    struct move *root = make_node(arena);
+
+    size_t len;
+    unsigned char *data = read_file(path, &len);
+    if (!data) {
+        *damage = "file can't be read";
+        release_arena(arena);
+        free(arena);
+        return root;
+    }
+    struct parser ps = { data, data + len, 0, NULL, 0, NULL, arena, NULL, NULL };
+
+    int flags = 0;
+    if (len >= DB_HEADER && !memcmp(data, DB_MAGIC, sizeof DB_MAGIC - 1)) {
+        ps.version = data[sizeof DB_MAGIC - 1];
+        flags = data[sizeof DB_MAGIC];
+        ps.p += DB_HEADER;
+        if (ps.version > DB_VERSION) damaged(&ps, "unknown format version");
+    }
+    if (ps.version >= 2) {
+        int unterminated = 0;
+        if (!(ps.p = read_strings(ps.p, ps.end, ps.version, &ps.strs, &ps.nstrs, &unterminated))) {
+            damaged(&ps, "damaged table of descriptions");
+            ps.p = ps.end;
+        }
+        if (unterminated) damaged(&ps, "unterminated description");
+        ps.uses = calloc(ps.nstrs ? ps.nstrs : 1, sizeof *ps.uses);
+    }
+
+    // the index is at the end, followed by its offset
+    const unsigned char *index = NULL;
+    // (a tree without descriptions has no moves, so nothing to split up)
+    if ((flags & DB_INDEXED) && ps.end - ps.p >= 8) {
+        uint64_t offset = 0;
+        for (int i = 0; i < 8; ++i) offset = offset << 8 | ps.end[i-8];
+        if (offset >= (uint64_t)(ps.p - data) && offset <= len - 8) {
+            if (ps.nstrs) index = data + offset;
+            ps.end = data + offset;
+        }
+    }
+
+    const unsigned char *tree = ps.p;
+    if (index && !load_parallel(&ps, root, index, data + len - 8)) {
+        // start over on one thread, which gets as far as it can
+        for (size_t i = 0; i < ps.nstrs; ++i) intern_ref(ps.strs[i], ps.uses[i]);
+        db_free(root);
+        memset(ps.uses, 0, ps.nstrs * sizeof *ps.uses);
+        root = make_node(arena);
+        ps.p = tree;
+        ps.last = NULL;
+        index = NULL;
+        if (parse_nodes(&ps, root, NULL)) damaged(&ps, "index doesn't match the tree");
+        else if (ps.last && !ps.last->desc) ps.last->desc = intern("");
+    } else if (!index && !parse_nodes(&ps, root, NULL) && ps.last && !ps.last->desc) {
+        ps.last->desc = intern("");
+    }
+    if (ps.p != ps.end) damaged(&ps, "data after the end of the tree");
+    *damage = ps.damage;
+    if (ps.damage) count_tree(root);
+
+    for (size_t i = 0; i < ps.nstrs; ++i) {
+        intern_ref(ps.strs[i], ps.uses[i]);
+        unintern(ps.strs[i]);
+    }
+    free(ps.strs);
+    free(ps.uses);
+    free(data);
+    release_arena(arena);
+    free(arena);
+    return root;
+}
+
+struct move* db_load(const char *path) {
+    return db_read(path, &db_damage);
+}
+
+// the descriptions used by a tree, in the order they were first seen, with
+// how often each is used, and a hash table from each of them to its entry
+struct desc_count {
+    const char *desc;
+    size_t count, first;
+};
+
+struct desc_table {
+    struct desc_count *list;
+    size_t n;
+    const char **keys;
+    size_t *vals;
+    size_t mask;
+};
+
+// returns the value for key, which is -1 if it has only just been added
+static size_t* desc_slot(struct desc_table *t, const char *key) {
+    size_t i = ((uintptr_t)key >> 4) * 0x9e3779b97f4a7c15ULL >> 20 & t->mask;
+    while (t->keys[i] && t->keys[i] != key) i = (i + 1) & t->mask;
+    if (!t->keys[i]) {
+        t->keys[i] = key;
+        t->vals[i] = -1;
+    }
+    return &t->vals[i];
+}
+
+static void count_desc(struct desc_table *t, const char *key) {
+    if (2 * (t->n + 1) > t->mask) {
+        free(t->keys);
+        free(t->vals);
+        t->mask = 2 * t->mask + 1;
+        t->keys = calloc(t->mask + 1, sizeof *t->keys);
+        t->vals = malloc((t->mask + 1) * sizeof *t->vals);
+        t->list = realloc(t->list, (t->mask + 1) / 2 * sizeof *t->list);
+        for (size_t i = 0; i < t->n; ++i) *desc_slot(t, t->list[i].desc) = i;
+    }
+
+    size_t *idx = desc_slot(t, key);
+    if (*idx == (size_t)-1) {
+        *idx = t->n;
+        t->list[t->n] = (struct desc_count){ key, 0, t->n };
+        ++t->n;
+    }
+    ++t->list[*idx].count;
+}
+
+// most used first, so that they get the shortest indices, and otherwise in
+// the order they come in the tree, so that saving the same tree always gives
+// the same file
+static int by_count(const void *a, const void *b) {
+    const struct desc_count *x = a, *y = b;
+    if (x->count != y->count) return x->count > y->count ? -1 : 1;
+    return x->first < y->first ? -1 : 1;
+}
+
+static void write_block(FILE *f, const unsigned char *raw, size_t len) {
+    uLongf stored = compressBound(len);
+    unsigned char *out = db_compression ? malloc(stored) : NULL;
+    if (out && compress2(out, &stored, raw, len, db_compression) == Z_OK && stored < len) {
+        put_varint(f, len);
+        put_varint(f, stored);
+        fwrite(out, 1, stored, f);
+    } else {
+        put_varint(f, len);
+        put_varint(f, len);
+        fwrite(raw, 1, len, f);
+    }
+    free(out);
+}
+
+// writes the table of descriptions used under root, leaving t mapping each of
+// them to its index in it
+static void write_strings(FILE *f, struct move *root, struct desc_table *t) {
+    for (struct move *m = root->child; m; ) {
+        count_desc(t, m->desc);
+        if (m->child) {
+            m = m->child;
+            continue;
+        }
+        while (m != root && !m->next) m = m->parent;
+        m = m == root ? NULL : m->next;
+    }
+
+    struct desc_count *descs = t->list;
+    size_t n = t->n;
+    qsort(descs, n, sizeof *descs, by_count);
+    put_varint(f, n);
+
+    // blocks are filled up with whole descriptions
+    size_t nblocks = 0, len = 0;
+    for (size_t i = 0; i < n; ++i) {
+        size_t dlen = strlen(descs[i].desc) + 1;
+        if (len && len + dlen > DB_BLOCK) ++nblocks, len = 0;
+        len += dlen;
+    }
+    put_varint(f, nblocks + (len > 0));
+
+    size_t cap = DB_BLOCK;
+    unsigned char *block = malloc(cap);
+    len = 0;
+    for (size_t i = 0; i < n; ++i) {
+        *desc_slot(t, descs[i].desc) = i;
+        size_t dlen = strlen(descs[i].desc) + 1;
+        if (len && len + dlen > DB_BLOCK) {
+            write_block(f, block, len);
+            len = 0;
+        }
+        if (dlen > cap) block = realloc(block, cap = dlen);
+        memcpy(block + len, descs[i].desc, dlen);
+        len += dlen;
+    }
+    if (len) write_block(f, block, len);
+    free(block);
+}
+
+// the depth at which the tree is split up for loading on several threads: the
+// first with at least DB_SPLIT moves, or failing that the one with the most
+#define MAX_SPLIT 64
+size_t db_split_depth(struct move *root) {
+    size_t count[MAX_SPLIT] = {0}, depth = 1;
+    for (struct move *m = root->child; m; ) {
+        if (depth < MAX_SPLIT) ++count[depth];
+        if (m->child) {
+            m = m->child;
+            ++depth;
+            continue;
+        }
+        while (m != root && !m->next) m = m->parent, --depth;
+        m = m == root ? NULL : m->next;
+    }
+
+    size_t best = 1;
+    for (size_t d = 1; d < MAX_SPLIT && count[d]; ++d) {
+        if (count[d] >= DB_SPLIT) return d;
+        if (count[d] > count[best]) best = d;
+    }
+    return best;
+}
+
+// writes the nodes under root, each followed by its children and then FF, and
+// then a final FF (without recursion, since lines can be arbitrarily long),
+// and then the index of the subtrees at depth split
+static void write_tree(FILE *f, struct move *root, struct desc_table *t, size_t split) {
+    size_t n = 0, cap = 1024, depth = 1;
+    uint64_t *lens = malloc(cap * sizeof *lens);
+    long start = 0;
+
+    struct move *m = root->child;
+    while (m) {
+        fputc(m->from, f);
+        fputc(m->to, f);
+        put_varint(f, *desc_slot(t, m->desc));
+        if (depth == split) start = ftell(f);
+        if (m->child) {
+            m = m->child;
+            ++depth;
+            continue;
+        }
+
+        // m is done, and so is every ancestor whose last child we're in
+        for (;;) {
+            fputc(255, f);
+            if (depth == split) {
+                if (n == cap) lens = realloc(lens, (cap *= 2) * sizeof *lens);
+                lens[n++] = ftell(f) - start;
+            }
+            if (m->next || m->parent == root) break;
+            m = m->parent;
+            --depth;
+        }
+        m = m->next;
+    }
+    fputc(255, f);
+
+    unsigned char offset[8];
+    uint64_t at = ftell(f);
+    for (int i = 0; i < 8; ++i) offset[7-i] = at >> (8*i) & 0xff;
+    put_varint(f, split);
+    put_varint(f, n);
+    for (size_t i = 0; i < n; ++i) put_varint(f, lens[i]);
+    fwrite(offset, 1, 8, f);
+    free(lens);
+}
+
+// saves the tree under root to a database file, with the generation after the
+// file's current one
+// the file is written beside the old one and then renamed over it, so anyone
+// reading it at the same time sees either version in full
+int db_save(struct move *root, const char *path) {
+    unsigned char header[DB_HEADER] = DB_MAGIC;
+    header[sizeof DB_MAGIC - 1] = DB_VERSION;
+    header[sizeof DB_MAGIC] = DB_INDEXED;
+    uint64_t gen = db_generation(path) + 1;
+    for (int i = 0; i < 8; ++i) header[DB_HEADER-1-i] = gen >> (8*i) & 0xff;
+
+    char *tmp = malloc(strlen(path) + sizeof ".tmp");
+    sprintf(tmp, "%s.tmp", path);
+    FILE *f = fopen(tmp, "wb");
+    if (!f) {
+        free(tmp);
+        return -1;
+    }
+
+    // keep the permissions of the file being replaced (a shared book is
+    // likely group writable)
+    struct stat st;
+    if (!stat(path, &st)) fchmod(fileno(f), st.st_mode & 07777);
+
+    struct desc_table t = { malloc(512 * sizeof *t.list), 0,
+        calloc(1024, sizeof *t.keys), malloc(1024 * sizeof *t.vals), 1023 };
+    fwrite(header, 1, DB_HEADER, f);
+    write_strings(f, root, &t);
+    write_tree(f, root, &t, db_split_depth(root));
+    free(t.list);
+    free(t.keys);
+    free(t.vals);
+    int err = fflush(f) || fsync(fileno(f));
+    err |= fclose(f) != 0;
+    if (!err) err = rename(tmp, path);
+    if (err) remove(tmp);
+    free(tmp);
+    return err ? -1 : 0;
+}
+
+// reads the generation counter of a database file (0 if it's missing or
+// predates the header)
+uint64_t db_generation(const char *path) {
+    unsigned char header[DB_HEADER];
+    FILE *f = fopen(path, "rb");
+    if (!f) return 0;
+    size_t n = fread(header, 1, DB_HEADER, f);
+    fclose(f);
+    if (n != DB_HEADER || memcmp(header, DB_MAGIC, sizeof DB_MAGIC - 1)) return 0;
+
+    uint64_t gen = 0;
+    for (int i = DB_HEADER - 8; i < DB_HEADER; ++i) gen = gen << 8 | header[i];
+    return gen;
+}
+
+// (see db_lock and db_trylock)
+static int take_lock(const char *path, int wait) {
+    char *lock_path = malloc(strlen(path) + sizeof ".lock");
+    sprintf(lock_path, "%s.lock", path);
+    int fd = open(lock_path, O_RDWR | O_CREAT, 0666);
+    free(lock_path);
+    if (fd == -1) return -1;
+
+    struct flock fl = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+    while (fcntl(fd, wait ? F_SETLKW : F_SETLK, &fl) == -1) {
+        if (errno != EINTR) {
+            int busy = !wait && (errno == EAGAIN || errno == EACCES);
+            close(fd);
+            errno = busy ? EAGAIN : 0;
+            return -1;
+        }
+    }
+    return fd;
+}
+
+// waits for exclusive access to a database file, for reading it and writing
+// back a modified version without losing anyone else's changes in between
+// the lock is an fcntl lock on a separate file (PATH.lock), since saving
+// replaces the database file itself, and fcntl locks also work over NFS
+// returns the descriptor to pass to db_unlock, or -1 if the lock file can't
+// be created (in which case there's nothing to do but go ahead unlocked)
+int db_lock(const char *path) {
+    return take_lock(path, 1);
+}
+
+// like db_lock, but fails with errno set to EAGAIN instead of waiting if
+// someone else has the lock
+int db_trylock(const char *path) {
+    return take_lock(path, 0);
+}
+
+void db_unlock(int fd) {
+    // closing the file releases the lock
+    if (fd != -1) close(fd);
+}
+
+// frees root and everything under it, without recursion
+void db_free(struct move *root) {
+    pthread_mutex_lock(&free_lock);
+    struct move *m = root;
+    while (m) {
+        if (m->child) {
+            m = m->child;
+            continue;
+        }
+
+        // m is always the first child of its parent here, so unlinking it
+        // turns the parent into a leaf once its last child is gone
+        struct move *next = m->next ? m->next : m->parent;
+        if (m->parent) m->parent->child = m->next;
+        unintern(m->desc);
+        push_free(m);
+        m = next;
+    }
+    pthread_mutex_unlock(&free_lock);
+}
+
+// calls fn on every node under root in preorder, along with its depth (1 for
+// the children of root) and the position its move is made from
+// start is the position at root, or NULL for the starting position
+void db_walk(struct move *root, struct position *start,
+        void (*fn)(struct move *node, struct position *pos, size_t depth, void *data),
+        void *data) {
+    size_t cap = 64, depth = 1;
+    struct position *stack = malloc(cap * sizeof *stack);
+    if (start) stack[0] = *start;
+    else position_init(&stack[0]);
+
+    for (struct move *m = root->child; m; ) {
+        fn(m, &stack[depth-1], depth, data);
+
+        if (m->child) {
+            if (depth == cap) stack = realloc(stack, (cap *= 2) * sizeof *stack);
+            stack[depth] = stack[depth-1];
+            position_move(&stack[depth], X(m->from), Y(m->from), X(m->to), Y(m->to));
+            m = m->child;
+            ++depth;
+            continue;
+        }
+        while (m != root && !m->next) m = m->parent, --depth;
+        m = m == root ? NULL : m->next;
+    }
+    free(stack);
+}
+
+static struct move* find_child(struct move *node, int from, int to) {
+    struct move *m = node->child;
+    while (m && (m->from != from || m->to != to)) m = m->next;
+    return m;
+}
+
+// unlinks node from its parent and frees it along with everything under it
+void db_remove(struct move *node) {
+    struct move *parent = node->parent, **link = &parent->child;
+    while (*link != node) link = &(*link)->next;
+    *link = node->next;
+    node->next = node->parent = NULL;
+    count_out(parent, node);
+    db_free(node);
+}
+
+// links node (and everything under it) in as the last child of parent
+void db_add(struct move *parent, struct move *node) {
+    struct move **tail = &parent->child;
+    while (*tail) tail = &(*tail)->next;
+    *tail = node;
+    node->next = NULL;
+    node->parent = parent;
+    count_in(node);
+}
+
+// merges dup, a second copy of the move first stored under the same parent,
+// into first and removes it: moves only one of them has are moved over, those
+// both have are merged the same way, and a description only dup has is kept
+void db_fold(struct move *first, struct move *dup) {
+    struct move *parent = dup->parent, **link = &parent->child;
+    while (*link != dup) link = &(*link)->next;
+    *link = dup->next;
+    dup->next = dup->parent = NULL;
+    count_out(parent, dup);
+
+    size_t n = 0, cap = 64;
+    struct move **stack = malloc(2 * cap * sizeof *stack);
+    stack[n++] = first;
+    stack[n++] = dup;
+    while (n) {
+        struct move *d = stack[--n], *f = stack[--n];
+        if (!*f->desc && *d->desc) db_set_desc(f, d->desc);
+        for (struct move **link = &d->child; *link; ) {
+            struct move *dc = *link, *fc = find_child(f, dc->from, dc->to);
+            if (fc) {
+                if (2 * cap == n) stack = realloc(stack, 2 * (cap *= 2) * sizeof *stack);
+                stack[n++] = fc;
+                stack[n++] = dc;
+                link = &dc->next;
+                continue;
+            }
+            *link = dc->next;
+            db_add(f, dc);
+        }
+    }
+    free(stack);
+    db_free(dup);
+}
+
+// makes the tree under live the same as the one under disk (a freshly loaded
+// copy of the file), while leaving every node that's in both where it is, so
+// that pointers into live stay valid; disk is freed in the process
+// nodes in keep (NULL entries are ignored) and their ancestors are kept even
+// if they're gone from disk, since something still refers to them
+// returns whether anything in live changed
+int db_merge(struct move *live, struct move *disk, struct move **keep, size_t nkeep) {
+    // (marked with a flag on each node, and unmarked again at the end; the
+    // ancestors of the nodes kept are shared, so the walk up stops at the
+    // first one marked already)
+    size_t npinned = 0, cappinned = 64;
+    struct move **pinned = malloc(cappinned * sizeof *pinned);
+    for (size_t i = 0; i < nkeep; ++i) {
+        for (struct move *m = keep[i]; m && m != live && !m->pinned; m = m->parent) {
+            if (npinned == cappinned) pinned = realloc(pinned, (cappinned *= 2) * sizeof *pinned);
+            pinned[npinned++] = m;
+            m->pinned = 1;
+        }
+    }
+
+    // pairs of corresponding nodes still to be merged (the disk one is NULL
+    // for pinned nodes that are gone from disk)
+    size_t n = 0, cap = 64;
+    struct move **stack = malloc(2 * cap * sizeof *stack);
+    stack[n++] = live;
+    stack[n++] = disk;
+
+    int changed = 0;
+    while (n) {
+        struct move *d = stack[--n], *l = stack[--n];
+
+        // drop whatever disk doesn't have, unless it's pinned
+        for (struct move *c = l->child, *next; c; c = next) {
+            next = c->next;
+            struct move *dc = d ? find_child(d, c->from, c->to) : NULL;
+            if (dc || c->pinned) {
+                if (2 * cap == n) stack = realloc(stack, 2 * (cap *= 2) * sizeof *stack);
+                stack[n++] = c;
+                stack[n++] = dc;
+            } else {
+                db_remove(c);
+                changed = 1;
+            }
+        }
+        if (!d) continue;
+
+        if (l != live && l->desc != d->desc) {
+            db_set_desc(l, d->desc);
+            changed = 1;
+        }
+
+        // and take over whole subtrees that live doesn't have
+        for (struct move **link = &d->child; *link; ) {
+            struct move *dc = *link;
+            if (find_child(l, dc->from, dc->to)) {
+                link = &dc->next;
+                continue;
+            }
+            *link = dc->next;
+            db_add(l, dc);
+            changed = 1;
+        }
+    }
+
+    free(stack);
+    for (size_t i = 0; i < npinned; ++i) pinned[i]->pinned = 0;
+    free(pinned);
+    db_free(disk);
+    return changed;
+}
+
+// adds the totals up again from scratch and returns the first node (children
+// before their parents) whose stored ones differ, or NULL if they all match
+// (the sums for the nodes on the way down are kept on a stack of their own,
+// so the tree itself isn't touched)
+struct move* db_check_totals(struct move *root) {
+    struct tally { uint32_t below, empty, depth; };
+    size_t depth = 0, cap = 64;
+    struct tally *stack = malloc(cap * sizeof *stack);
+    stack[0] = (struct tally){ 0, 0, 0 };
+
+    struct move *bad = NULL, *m = root->child;
+    while (m && !bad) {
+        if (++depth == cap) stack = realloc(stack, (cap *= 2) * sizeof *stack);
+        stack[depth] = (struct tally){ 0, 0, 0 };
+        if (m->child) {
+            m = m->child;
+            continue;
+        }
+        // m is finished, and so is each parent whose last child it is
+        for (;;) {
+            struct tally *t = &stack[depth], *p = &stack[--depth];
+            if (t->below != m->below || t->empty != m->below_empty || t->depth != m->below_depth) {
+                bad = m;
+                break;
+            }
+            p->below += 1 + t->below;
+            p->empty += !*m->desc + t->empty;
+            if (p->depth < 1 + t->depth) p->depth = 1 + t->depth;
+            if (m->next) {
+                m = m->next;
+                break;
+            }
+            if ((m = m->parent) == root) {
+                m = NULL;
+                break;
+            }
+        }
+    }
+    if (!bad && (stack[0].below != root->below || stack[0].empty != root->below_empty ||
+            stack[0].depth != root->below_depth)) {
+        bad = root;
+    }
+    free(stack);
+    return bad;
+}
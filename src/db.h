@@ -0,0 +1,109 @@
+/*
+ * atop - opening database for atomic chess
+ * Copyright (C) 2018  Keyboard Fire <andy@keyboardfire.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DB_H__
+#define __DB_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// each move has exactly one child, which is a linked list representing all the
+// stored moves from that position
+// all of the elements of this linked list have their parent set to the same
+// node to facilitate navigation
+// each node also keeps totals for the moves below it: how many there are, how
+// many of them have no description, and the length of the longest line down
+// from it; these are filled in by db_load and kept up to date by db_add,
+// db_remove, db_set_desc, db_merge and db_fold (so trees built by hand don't
+// have them)
+struct move {
+    unsigned char from;
+    unsigned char to;
+    unsigned char pinned;   // only set during db_merge (it fits in the padding)
+    uint32_t below;
+    const char *desc;   // interned, so only ever set with db_set_desc
+    struct move *next;
+    struct move *child;
+    struct move *parent;
+    uint32_t below_empty;
+    uint32_t below_depth;
+};
+
+// database files start with a header of the magic below, a format version, a
+// byte of flags and a generation counter (8 bytes, big endian) that
+// is incremented by every save, so that programs sharing a file can tell
+// cheaply whether it has changed
+//
+// then come all the distinct descriptions, most used first: their number and
+// the number of blocks they're in (varints), then blocks of NUL-terminated
+// descriptions, each block being its raw and stored lengths (varints) and the
+// zlib-compressed descriptions, or the descriptions themselves if the two
+// lengths are equal (version 2 files leave out the number of blocks)
+//
+// then the tree: each node is the from and to squares (a byte each), the index
+// of its description (a varint), its children and FF, and a final FF ends the
+// top level moves
+//
+// with DB_INDEXED set, the tree is followed by an index for loading it on
+// several threads: a depth, the number of moves at that depth, the length of
+// each of their subtrees (from after the description up to and including the
+// FF), all varints, and lastly the offset of the index (8 bytes, big endian)
+//
+// version 1 files, and those from before the header, have the same tree but
+// with each description stored inline, NUL-terminated, in place of its index
+#define DB_MAGIC   "ATOPDB"
+#define DB_VERSION 3
+#define DB_HEADER  16
+#define DB_INDEXED 1
+
+// the index is for the first depth with at least this many moves, so that the
+// threads have plenty of subtrees to share out; db_threads is how many
+// threads to load on (0 for one per processor)
+#define DB_SPLIT   1024
+extern int db_threads;
+
+// descriptions are compressed in blocks of about this many bytes, at the zlib
+// level in db_compression (0 stores them as they are)
+#define DB_BLOCK   65536
+extern int db_compression;
+
+struct position;
+
+struct move* new_node();
+void db_set_desc(struct move *node, const char *desc);
+struct move* db_load(const char *path);
+// what db_load found wrong with the last file it read, or NULL if nothing
+extern const char *db_damage;
+struct move* db_read(const char *path, const char **damage);
+int db_save(struct move *root, const char *path);
+void db_free(struct move *root);
+void db_add(struct move *parent, struct move *node);
+void db_remove(struct move *node);
+void db_fold(struct move *first, struct move *dup);
+uint64_t db_generation(const char *path);
+int db_lock(const char *path);
+int db_trylock(const char *path);
+void db_unlock(int fd);
+int db_merge(struct move *live, struct move *disk, struct move **keep, size_t nkeep);
+void db_walk(struct move *root, struct position *start,
+        void (*fn)(struct move *node, struct position *pos, size_t depth, void *data),
+        void *data);
+size_t db_split_depth(struct move *root);
+struct move* db_check_totals(struct move *root);
+
+#endif
@@ -0,0 +1,197 @@
+/*
+ * atop - opening database for atomic chess
+ * Copyright (C) 2018  Keyboard Fire <andy@keyboardfire.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// atop gen - builds a synthetic database by playing random legal moves, for
+// testing and benchmarking the storage code on books of any size
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "cmd.h"
+#include "chess.h"
+#include "db.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// xorshift64*, so that a given seed always produces the same book
+static uint64_t rng_state;
+static uint64_t rng() {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static double rng_unit() {
+    return (rng() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// descriptions are strung together from these, with the occasional engine
+// evaluation thrown in, which roughly matches what real annotations repeat
+static const char *words[] = {
+    "main", "line", "trap!", "sideline", "refuted", "best", "only", "move",
+    "white", "black", "wins", "loses", "draw", "equal", "better", "worse",
+    "sacrifice", "explodes", "the", "king", "queen", "knight", "bishop", "rook",
+    "pawn", "threatens", "mate", "after", "with", "idea", "see", "game"
+};
+
+// and some annotations are used over and over on their own
+static const char *stock[] = {
+    "main line", "sideline", "trap!", "refuted", "only move", "best",
+    "equal", "white wins", "black wins", "draw", "see game", "dubious"
+};
+
+// returns a description whose length is exponentially distributed around mean
+static char* random_desc(double mean, double empty, double repeat) {
+    double r = rng_unit();
+    if (r < empty) return calloc(1, 1);
+    if (r < empty + repeat) {
+        char *buf = malloc(16);
+        if (rng() % 2) strcpy(buf, stock[rng() % (sizeof stock / sizeof *stock)]);
+        else sprintf(buf, "%+.2f", ((int)(rng() % 800) - 400) / 100.0);
+        return buf;
+    }
+
+    size_t len = -mean * log(1 - rng_unit()), idx = 0;
+    char *buf = malloc(len + 16);
+    while (idx < len) {
+        if (idx) buf[idx++] = ' ';
+        if (rng() % 8) {
+            const char *w = words[rng() % (sizeof words / sizeof *words)];
+            strcpy(buf + idx, w);
+            idx += strlen(w);
+        } else {
+            idx += sprintf(buf + idx, "(%+.2f)", ((int)(rng() % 800) - 400) / 100.0);
+        }
+    }
+    buf[idx] = '\0';
+    return buf;
+}
+
+// plays the moves leading up to node from the starting position
+static void replay(struct position *pos, struct move *node, struct move **path) {
+    int depth = 0;
+    for (; node->parent; node = node->parent) path[depth++] = node;
+    position_init(pos);
+    while (depth--) {
+        position_move(pos, X(path[depth]->from), Y(path[depth]->from),
+                X(path[depth]->to), Y(path[depth]->to));
+    }
+}
+
+static void usage() {
+    fputs("usage: atop gen [-n nodes] [-b branching] [-d depth] [-l desc length]\n"
+          "                [-e empty percent] [-r repeated percent] [-s seed]\n"
+          "                [-z level] FILE\n", stderr);
+}
+
+int cmd_gen(int argc, char **argv) {
+    long target = 10000, branching = 3, max_depth = 40, empty = 50, repeat = 20;
+    double mean_len = 40;
+    rng_state = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:b:d:l:e:r:s:z:")) != -1) {
+        switch (opt) {
+            case 'n': target = strtol(optarg, NULL, 10); break;
+            case 'b': branching = strtol(optarg, NULL, 10); break;
+            case 'd': max_depth = strtol(optarg, NULL, 10); break;
+            case 'l': mean_len = strtod(optarg, NULL); break;
+            case 'e': empty = strtol(optarg, NULL, 10); break;
+            case 'r': repeat = strtol(optarg, NULL, 10); break;
+            case 's': rng_state = strtoull(optarg, NULL, 10) | 1; break;
+            case 'z': db_compression = strtol(optarg, NULL, 10); break;
+            default: usage(); return 1;
+        }
+    }
+    if (optind != argc - 1 || target < 0 || branching < 1 || max_depth < 1) {
+        usage();
+        return 1;
+    }
+
+    struct move *root = new_node(), **path = malloc(max_depth * sizeof *path);
+    struct position pos;
+    int moves[MAX_MOVES];
+
+    // the tree is grown one level at a time, visiting each level in random
+    // order, so that the node budget is spread evenly instead of being used
+    // up by whichever line happens to come first
+    struct move **level = malloc(sizeof *level), **next = NULL;
+    size_t nlevel = 1, nnext, cap;
+    long count = 0, depth = 0;
+    level[0] = root;
+    for (; depth < max_depth && nlevel && count < target; ++depth) {
+        for (size_t i = nlevel - 1; i > 0; --i) {
+            size_t j = rng() % (i + 1);
+            struct move *tmp = level[i]; level[i] = level[j]; level[j] = tmp;
+        }
+
+        next = malloc((cap = nlevel) * sizeof *next);
+        nnext = 0;
+        for (size_t i = 0; i < nlevel && count < target; ++i) {
+            replay(&pos, level[i], path);
+            int n = generate_moves(&pos, moves),
+                k = 1 + rng() % (2*branching - 1);
+            if (k > n) k = n;
+            if (k > target - count) k = target - count;
+
+            struct move *prev = NULL;
+            for (int j = 0; j < k; ++j) {
+                // pick a random move that hasn't been used yet
+                int r = j + rng() % (n - j), m = moves[r];
+                moves[r] = moves[j];
+                moves[j] = m;
+
+                struct move *child = new_node();
+                child->from = FROM(m);
+                child->to = TO(m);
+                char *desc = random_desc(mean_len, empty / 100.0, repeat / 100.0);
+                db_set_desc(child, desc);
+                free(desc);
+                child->parent = level[i];
+                if (prev) prev->next = child;
+                else level[i]->child = child;
+                prev = child;
+
+                if (nnext == cap) next = realloc(next, (cap *= 2) * sizeof *next);
+                next[nnext++] = child;
+            }
+            count += k;
+        }
+
+        free(level);
+        level = next;
+        nlevel = nnext;
+    }
+    free(level);
+    free(path);
+
+    if (count < target) {
+        fprintf(stderr, "atop gen: only %ld nodes fit within depth %ld\n", count, max_depth);
+    }
+    if (db_save(root, argv[optind])) {
+        perror(argv[optind]);
+        return 1;
+    }
+    fprintf(stderr, "atop gen: wrote %ld nodes, %ld plies deep\n", count, depth);
+    return 0;
+}
@@ -0,0 +1,160 @@
+/*
+ * atop - opening database for atomic chess
+ * Copyright (C) 2018  Keyboard Fire <andy@keyboardfire.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "intern.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// each string is stored right after its hash and reference count, so that
+// unintern can get back to them from the string alone
+struct entry {
+    uint64_t hash;
+    size_t refs;
+    char str[];
+};
+
+// the table is split by hash into shards with a lock each, so that threads
+// can intern at the same time; each shard is an open addressing hash table
+// (linear probing, at most half full) keeping the hashes alongside, so that
+// looking a string up rarely touches any string but the one it's after
+#define SHARDS 64
+struct slot {
+    uint64_t hash;
+    struct entry *e;
+};
+
+struct shard {
+    pthread_mutex_t lock;
+    struct slot *slots;
+    size_t mask, n;
+};
+
+static struct shard shards[SHARDS];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+static void init_shards() {
+    for (int i = 0; i < SHARDS; ++i) pthread_mutex_init(&shards[i].lock, NULL);
+}
+
+static struct shard* shard_of(uint64_t hash) {
+    return &shards[hash >> 58];
+}
+
+static struct entry* entry_of(const char *str) {
+    return (struct entry*)(str - offsetof(struct entry, str));
+}
+
+// FNV-1a
+static uint64_t hash(const char *str, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; ++i) h = (h ^ (unsigned char)str[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+static void grow(struct shard *s) {
+    size_t cap = s->slots ? 2 * (s->mask + 1) : 64;
+    struct slot *slots = calloc(cap, sizeof *slots);
+    for (size_t i = 0; s->slots && i <= s->mask; ++i) {
+        if (!s->slots[i].e) continue;
+        size_t j = s->slots[i].hash & (cap - 1);
+        while (slots[j].e) j = (j + 1) & (cap - 1);
+        slots[j] = s->slots[i];
+    }
+    free(s->slots);
+    s->slots = slots;
+    s->mask = cap - 1;
+}
+
+// returns the shared copy of the first len bytes of str (which needn't be
+// NUL-terminated), adding a reference to it
+const char* intern_len(const char *str, size_t len) {
+    pthread_once(&shards_once, init_shards);
+    uint64_t h = hash(str, len);
+    struct shard *s = shard_of(h);
+    pthread_mutex_lock(&s->lock);
+    if (2 * (s->n + 1) > s->mask + 1) grow(s);
+
+    size_t i = h & s->mask;
+    for (; s->slots[i].e; i = (i + 1) & s->mask) {
+        struct entry *e = s->slots[i].e;
+        if (s->slots[i].hash == h && !strncmp(e->str, str, len) && !e->str[len]) {
+            ++e->refs;
+            pthread_mutex_unlock(&s->lock);
+            return e->str;
+        }
+    }
+
+    struct entry *e = malloc(sizeof *e + len + 1);
+    memcpy(e->str, str, len);
+    e->str[len] = '\0';
+    e->hash = h;
+    e->refs = 1;
+    s->slots[i] = (struct slot){ h, e };
+    ++s->n;
+    pthread_mutex_unlock(&s->lock);
+    return e->str;
+}
+
+const char* intern(const char *str) {
+    return intern_len(str, strlen(str));
+}
+
+// adds n references to a string returned by intern, without looking it up
+const char* intern_ref(const char *str, size_t n) {
+    struct entry *e = entry_of(str);
+    struct shard *s = shard_of(e->hash);
+    pthread_mutex_lock(&s->lock);
+    e->refs += n;
+    pthread_mutex_unlock(&s->lock);
+    return str;
+}
+
+// drops a reference to a string returned by intern, freeing it with the last
+void unintern(const char *str) {
+    if (!str) return;
+    struct entry *e = entry_of(str);
+    struct shard *s = shard_of(e->hash);
+    pthread_mutex_lock(&s->lock);
+    if (--e->refs) {
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+
+    // take it out, moving back any later entry of the same run that can't be
+    // found anymore otherwise
+    size_t i = e->hash & s->mask;
+    while (s->slots[i].e != e) i = (i + 1) & s->mask;
+    for (size_t j = i; ; ) {
+        j = (j + 1) & s->mask;
+        if (!s->slots[j].e) break;
+        size_t home = s->slots[j].hash & s->mask;
+        if (i <= j ? i < home && home <= j : i < home || home <= j) continue;
+        s->slots[i] = s->slots[j];
+        i = j;
+    }
+    s->slots[i].e = NULL;
+    --s->n;
+    pthread_mutex_unlock(&s->lock);
+    free(e);
+}
@@ -0,0 +1,31 @@
+/*
+ * atop - opening database for atomic chess
+ * Copyright (C) 2018  Keyboard Fire <andy@keyboardfire.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __INTERN_H__
+#define __INTERN_H__
+
+#include <stddef.h>
+
+// a table of reference counted strings, so that equal strings share one copy
+// (and can be compared by pointer), which any number of threads may use
+const char* intern(const char *str);
+const char* intern_len(const char *str, size_t len);
+const char* intern_ref(const char *str, size_t n);
+void unintern(const char *str);
+
+#endif
@@ -17,8 +17,31 @@
  */
 
 #include "atop.h"
+#include "cmd.h"
+
+#include <string.h>
+
+static const struct {
+    const char *name;
+    int (*run)(int argc, char **argv);
+} commands[] = {
+    { "gen",    cmd_gen },
+    { "bench",  cmd_bench },
+    { "export", cmd_export },
+    { "probe",  cmd_probe },
+    { "serve",  cmd_serve },
+    { "tb",     cmd_tb },
+    { "verify", cmd_verify },
+    { "uibench", cmd_uibench }
+};
 
 int main(int argc, char **argv) {
+    if (argc > 1) {
+        for (size_t i = 0; i < sizeof commands / sizeof *commands; ++i) {
+            if (!strcmp(argv[1], commands[i].name)) return commands[i].run(argc-1, argv+1);
+        }
+    }
+
     atop_init(&argc, &argv);
     return 0;
 }
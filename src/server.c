@@ -0,0 +1,448 @@
+/*
+ * atop - opening database for atomic chess
+ * Copyright (C) 2018  Keyboard Fire <andy@keyboardfire.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// atop serve - keeps a database loaded and answers lookups over a unix socket,
+// so that any number of local programs can share one copy of it
+//
+// requests are single lines, and are answered in order, so a client may send
+// several without waiting for the answers in between:
+//
+//     moves [MOVE...]   moves stored after the given line from the start
+//     hash KEY          moves stored from the position with this hash (see
+//                       position_hash, in hex), by any move order
+//     reload            reread the database file right away
+//
+// the answer is either "ok N" followed by N lines of "MOVE DESCRIPTION", or a
+// single line "err MESSAGE"; moves are in coordinate notation (e.g. e2e4), and
+// backslashes and newlines in descriptions are escaped as \\ and \n
+//
+// the database is reread when its file changes or on SIGHUP; the new tree and
+// its index are built on a thread of their own while requests go on being
+// answered from the old ones, and swapped in between two requests, so
+// connected clients never notice (a client's own reload is answered, and its
+// later requests read, once the swap has happened)
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "chess.h"
+#include "cmd.h"
+#include "db.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// longest request line accepted, and how much unsent output a client may have
+// before we stop reading its requests
+#define MAX_LINE    65536
+#define MAX_PENDING (1 << 20)
+
+struct buf {
+    char *data;
+    size_t len, cap;
+};
+
+static void buf_append(struct buf *b, const char *data, size_t len) {
+    if (b->len + len > b->cap) {
+        while (b->len + len > b->cap) b->cap = b->cap ? b->cap * 2 : 4096;
+        b->data = realloc(b->data, b->cap);
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+static void buf_puts(struct buf *b, const char *str) {
+    buf_append(b, str, strlen(str));
+}
+
+struct client {
+    int fd;
+    struct buf in, out;
+    size_t sent;    // how much of out has been written already
+    int waiting;    // sent reload, and is waiting for it to finish
+};
+
+// the loaded database, with every node indexed by the hash of the position its
+// move is made from (open addressing, linear probing, one slot per node)
+struct slot {
+    uint64_t key;
+    struct move *node;
+};
+struct index {
+    struct move *db;
+    struct slot *slots;
+    size_t mask;
+    size_t nnodes;
+    struct stat st;     // the state of the file when it was read
+};
+static struct move *db;
+static struct slot *slots;
+static size_t mask;
+static size_t nnodes;
+
+static const char *db_path;
+static struct stat db_stat;
+static volatile sig_atomic_t reload_requested, quit_requested;
+
+// the reload in progress, if any: the loader thread fills in loaded and then
+// writes a byte to loaded_pipe, which the poll loop watches
+static pthread_t loader;
+static int loading, reload_again;
+static int loaded_inline;   // there was no thread, so it was done on this one
+static struct index loaded;
+static int loaded_pipe[2];
+
+static void index_node(struct move *node, struct position *pos, size_t depth, void *data) {
+    (void)depth;
+    struct index *ix = data;
+    uint64_t key = position_hash(pos);
+    size_t i = key & ix->mask;
+    while (ix->slots[i].node) i = (i + 1) & ix->mask;
+    ix->slots[i].key = key;
+    ix->slots[i].node = node;
+}
+
+static void count_node(struct move *node, struct position *pos, size_t depth, void *data) {
+    (void)node; (void)pos; (void)depth;
+    ++*(size_t*)data;
+}
+
+// reads the database and indexes it, without touching what's being served
+static void build(struct index *ix) {
+    if (stat(db_path, &ix->st)) memset(&ix->st, 0, sizeof ix->st);
+    ix->db = db_load(db_path);
+
+    size_t n = 0, cap = 16;
+    db_walk(ix->db, NULL, count_node, &n);
+    while (cap < 2 * n) cap *= 2;
+    ix->slots = calloc(cap, sizeof *ix->slots);
+    ix->mask = cap - 1;
+    ix->nnodes = n;
+    db_walk(ix->db, NULL, index_node, ix);
+}
+
+static void* free_thread(void *arg) {
+    db_free(arg);
+    return NULL;
+}
+
+// starts serving ix instead (the old tree is freed on a thread, since that
+// takes about as long as loading it)
+static void swap_in(struct index *ix) {
+    if (db) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, free_thread, db)) db_free(db);
+        else pthread_detach(tid);
+    }
+    free(slots);
+    db = ix->db;
+    slots = ix->slots;
+    mask = ix->mask;
+    nnodes = ix->nnodes;
+    db_stat = ix->st;
+    fprintf(stderr, "atop serve: loaded %zu moves from %s\n", nnodes, db_path);
+}
+
+static void* load_thread(void *arg) {
+    (void)arg;
+    build(&loaded);
+    while (write(loaded_pipe[1], "", 1) == -1 && errno == EINTR);
+    return NULL;
+}
+
+// starts rereading the database, or makes sure it's reread again once the
+// reload under way is done (since the file may have changed after it was read)
+static void start_reload() {
+    if (loading) {
+        reload_again = 1;
+        return;
+    }
+    // (without a thread, it's done right here after all, and then finished
+    // off through the pipe like any other, so that waiting clients carry on)
+    loading = 1;
+    if (pthread_create(&loader, NULL, load_thread, NULL)) {
+        loaded_inline = 1;
+        load_thread(NULL);
+    }
+}
+
+static int file_changed() {
+    struct stat st;
+    if (stat(db_path, &st)) return 0;
+    return st.st_ino != db_stat.st_ino || st.st_size != db_stat.st_size ||
+        st.st_mtim.tv_sec != db_stat.st_mtim.tv_sec ||
+        st.st_mtim.tv_nsec != db_stat.st_mtim.tv_nsec;
+}
+
+static void reply_move(struct buf *out, struct move *m) {
+    char mv[5];
+    format_move(MOVE(m->from, m->to), mv);
+    buf_append(out, mv, 4);
+    buf_append(out, " ", 1);
+    for (const char *c = m->desc; *c; ++c) {
+        if (*c == '\\') buf_append(out, "\\\\", 2);
+        else if (*c == '\n') buf_append(out, "\\n", 2);
+        else buf_append(out, c, 1);
+    }
+    buf_append(out, "\n", 1);
+}
+
+static void reply_count(struct buf *out, int n) {
+    char head[32];
+    sprintf(head, "ok %d\n", n);
+    buf_puts(out, head);
+}
+
+static void answer_moves(struct buf *out, char *args) {
+    struct move *cur = db;
+    for (char *tok = strtok(args, " "); tok; tok = strtok(NULL, " ")) {
+        int mv = parse_move(tok);
+        if (mv == -1) {
+            buf_puts(out, "err bad move\n");
+            return;
+        }
+        struct move *m = cur->child;
+        while (m && MOVE(m->from, m->to) != mv) m = m->next;
+        if (!m) {
+            buf_puts(out, "err not in database\n");
+            return;
+        }
+        cur = m;
+    }
+
+    int n = 0;
+    for (struct move *m = cur->child; m; m = m->next) ++n;
+    reply_count(out, n);
+    for (struct move *m = cur->child; m; m = m->next) reply_move(out, m);
+}
+
+static void answer_hash(struct buf *out, char *args) {
+    char *end;
+    uint64_t key = strtoull(args, &end, 16);
+    if (!*args || *end) {
+        buf_puts(out, "err bad hash\n");
+        return;
+    }
+
+    // a position reached by several move orders has a node for each, so keep
+    // only the first node seen for every move
+    struct move *found[MAX_MOVES];
+    int n = 0;
+    for (size_t i = key & mask; slots[i].node; i = (i + 1) & mask) {
+        if (slots[i].key != key) continue;
+        int mv = MOVE(slots[i].node->from, slots[i].node->to), dup = 0;
+        for (int j = 0; j < n; ++j) dup |= MOVE(found[j]->from, found[j]->to) == mv;
+        if (!dup && n < MAX_MOVES) found[n++] = slots[i].node;
+    }
+
+    reply_count(out, n);
+    for (int i = 0; i < n; ++i) reply_move(out, found[i]);
+}
+
+static void answer(struct buf *out, char *line) {
+    char *args = strchr(line, ' ');
+    if (args) *args++ = '\0';
+    else args = line + strlen(line);
+
+    if (!strcmp(line, "moves")) answer_moves(out, args);
+    else if (!strcmp(line, "hash")) answer_hash(out, args);
+    else buf_puts(out, "err unknown request\n");
+}
+
+// answers every complete line received so far, returning -1 if the client
+// should be dropped
+// a reload stops the answering until it's done (see cmd_serve)
+static int handle_input(struct client *c) {
+    size_t start = 0;
+    for (size_t i = 0; i < c->in.len && !c->waiting; ++i) {
+        if (c->in.data[i] != '\n') continue;
+        c->in.data[i] = '\0';
+        if (i > start && c->in.data[i-1] == '\r') c->in.data[i-1] = '\0';
+        if (!strcmp(c->in.data + start, "reload")) {
+            c->waiting = 1;
+            start_reload();
+        } else answer(&c->out, c->in.data + start);
+        start = i + 1;
+    }
+    memmove(c->in.data, c->in.data + start, c->in.len - start);
+    c->in.len -= start;
+    return c->in.len > MAX_LINE ? -1 : 0;
+}
+
+static int flush_output(struct client *c) {
+    while (c->sent < c->out.len) {
+        ssize_t n = send(c->fd, c->out.data + c->sent, c->out.len - c->sent, MSG_NOSIGNAL);
+        if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        c->sent += n;
+    }
+    c->sent = c->out.len = 0;
+    return 0;
+}
+
+static void on_signal(int sig) {
+    if (sig == SIGHUP) reload_requested = 1;
+    else quit_requested = 1;
+}
+
+int cmd_serve(int argc, char **argv) {
+    const char *sock_path = "atop.sock";
+    int opt;
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        switch (opt) {
+            case 's': sock_path = optarg; break;
+            default:
+                fputs("usage: atop serve [-s socket] [DATABASE]\n", stderr);
+                return 1;
+        }
+    }
+    db_path = optind < argc ? argv[optind] : "atop.db";
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(sock_path) >= sizeof addr.sun_path) {
+        fprintf(stderr, "atop serve: socket path too long\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, sock_path);
+    int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(sock_path);
+    if (lfd == -1 || bind(lfd, (struct sockaddr*)&addr, sizeof addr) || listen(lfd, 64)) {
+        perror(sock_path);
+        return 1;
+    }
+    fcntl(lfd, F_SETFL, O_NONBLOCK);
+
+    struct sigaction sa = { .sa_handler = on_signal };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGHUP, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    build(&loaded);
+    swap_in(&loaded);
+    if (pipe(loaded_pipe)) {
+        perror("atop serve");
+        return 1;
+    }
+
+    size_t nclients = 0, cap = 16;
+    struct client *clients = malloc(cap * sizeof *clients);
+    struct pollfd *fds = malloc((cap + 2) * sizeof *fds);
+    time_t last_check = time(NULL);
+    while (!quit_requested) {
+        // the file is checked for changes at most once a second (and not
+        // while it's being read, as that's compared with the file once done)
+        if (time(NULL) != last_check && !loading) {
+            last_check = time(NULL);
+            if (file_changed()) reload_requested = 1;
+        }
+        if (reload_requested) {
+            reload_requested = 0;
+            start_reload();
+        }
+
+        // the reload pipe is last, after the clients
+        fds[0].fd = lfd;
+        fds[0].events = POLLIN;
+        for (size_t i = 0; i < nclients; ++i) {
+            fds[i+1].fd = clients[i].fd;
+            fds[i+1].events = (clients[i].out.len < MAX_PENDING && !clients[i].waiting ? POLLIN : 0) |
+                (clients[i].sent < clients[i].out.len ? POLLOUT : 0);
+            fds[i+1].revents = 0;
+        }
+        fds[nclients+1].fd = loaded_pipe[0];
+        fds[nclients+1].events = POLLIN;
+        fds[nclients+1].revents = 0;
+        if (poll(fds, nclients + 2, 1000) < 0) continue;
+
+        // swap in a finished reload, and carry on with the clients that were
+        // waiting for it
+        if (fds[nclients+1].revents & POLLIN) {
+            char byte;
+            while (read(loaded_pipe[0], &byte, 1) == -1 && errno == EINTR);
+            if (!loaded_inline) pthread_join(loader, NULL);
+            loaded_inline = loading = 0;
+            swap_in(&loaded);
+            if (reload_again) {
+                reload_again = 0;
+                start_reload();
+            }
+            for (size_t i = 0; i < nclients; ++i) {
+                struct client *c = &clients[i];
+                if (!c->waiting || loading) continue;
+                c->waiting = 0;
+                reply_count(&c->out, 0);
+                if (handle_input(c) || flush_output(c)) shutdown(c->fd, SHUT_RDWR);
+            }
+        }
+
+        for (size_t i = 0; i < nclients; ++i) {
+            struct client *c = &clients[i];
+            int drop = 0;
+            if (fds[i+1].revents & POLLIN) {
+                char chunk[4096];
+                ssize_t n = read(c->fd, chunk, sizeof chunk);
+                if (n > 0) {
+                    buf_append(&c->in, chunk, n);
+                    drop = handle_input(c);
+                } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) drop = 1;
+            } else if (fds[i+1].revents & (POLLHUP | POLLERR)) drop = 1;
+
+            // answers are sent straight away rather than on the next poll
+            if (!drop) drop = flush_output(c);
+
+            if (drop) {
+                close(c->fd);
+                free(c->in.data);
+                free(c->out.data);
+                *c = clients[--nclients];
+                fds[i+1] = fds[nclients+1];
+                --i;
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd;
+            while ((fd = accept(lfd, NULL, NULL)) != -1) {
+                fcntl(fd, F_SETFL, O_NONBLOCK);
+                if (nclients == cap) {
+                    cap *= 2;
+                    clients = realloc(clients, cap * sizeof *clients);
+                    fds = realloc(fds, (cap + 2) * sizeof *fds);
+                }
+                memset(&clients[nclients], 0, sizeof *clients);
+                clients[nclients++].fd = fd;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < nclients; ++i) close(clients[i].fd);
+    if (loading && !loaded_inline) pthread_join(loader, NULL);
+    close(lfd);
+    unlink(sock_path);
+    return 0;
+}
@@ -0,0 +1,606 @@
+/*
+ * atop - opening database for atomic chess
+ * Copyright (C) 2018  Keyboard Fire <andy@keyboardfire.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "tb.h"
+#include "chess.h"
+#include "cmd.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// only used while generating, for positions not resolved yet
+#define UNRESOLVED 254
+
+// losses must stay below UNRESOLVED once TB_LOSS is added
+#define MAX_LOSS (UNRESOLVED - TB_LOSS)
+
+// a table found missing isn't looked for on disk again for this many seconds
+// (it may have been generated in the meantime)
+#define TB_RETRY 10
+
+struct table {
+    char name[8];
+    int n;
+    int piece[TB_PIECES];   // piece of each index slot, signed by color
+    size_t size;            // number of positions, 2 * 64^n
+    unsigned char *val;
+    size_t maplen;          // length of the mapping, if read from a file
+    time_t missed;          // when it was found missing (val is NULL then)
+    struct table *next;
+};
+
+// every table loaded or generated so far, and those found missing
+static struct table *tables;
+static pthread_mutex_t tables_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *order = "KQRBN";
+static const int types[] = { KING, QUEEN, ROOK, BISHOP, KNIGHT };
+
+// writes the canonical name of the given material (counts of each piece type
+// in the order above, for white then black), returning 0 if it is too much
+// or either king is missing
+static int material_name(int count[2][5], char name[8]) {
+    int n = 0, idx = 0;
+    for (int c = 0; c < 2; ++c) {
+        if (count[c][0] != 1) return 0;
+        for (int t = 0; t < 5; ++t) n += count[c][t];
+    }
+    if (n > TB_PIECES) return 0;
+
+    for (int c = 0; c < 2; ++c) {
+        if (c) name[idx++] = 'v';
+        for (int t = 0; t < 5; ++t) {
+            for (int i = 0; i < count[c][t]; ++i) name[idx++] = order[t];
+        }
+    }
+    name[idx] = '\0';
+    return 1;
+}
+
+// the name with colors swapped (KQvKR -> KRvKQ)
+static void flip_name(const char *name, char flipped[8]) {
+    const char *v = strchr(name, 'v');
+    sprintf(flipped, "%sv%.*s", v + 1, (int)(v - name), name);
+}
+
+static int board_material(int board[8][8], char name[8]) {
+    int count[2][5] = {{0}};
+    for (int i = 0; i < 8; ++i) {
+        for (int j = 0; j < 8; ++j) {
+            if (!board[i][j]) continue;
+            int t = 0;
+            while (t < 5 && types[t] != abs(board[i][j])) ++t;
+            if (t == 5) return 0;
+            ++count[board[i][j] < 0][t];
+        }
+    }
+    return material_name(count, name);
+}
+
+static struct table* new_table(const char *name) {
+    int count[2][5] = {{0}}, c = 0;
+    for (const char *p = name; *p; ++p) {
+        if (*p == 'v' && !c) { c = 1; continue; }
+        const char *t = strchr(order, *p);
+        if (!t) return NULL;
+        ++count[c][t - order];
+    }
+
+    struct table *t = calloc(1, sizeof *t);
+    if (!c || !material_name(count, t->name)) {
+        free(t);
+        return NULL;
+    }
+    for (int cc = 0; cc < 2; ++cc) {
+        for (int tt = 0; tt < 5; ++tt) {
+            for (int i = 0; i < count[cc][tt]; ++i) t->piece[t->n++] = (cc ? -1 : 1) * types[tt];
+        }
+    }
+    t->size = 2;
+    for (int i = 0; i < t->n; ++i) t->size *= 64;
+    return t;
+}
+
+// reads a table from the tb directory, returning NULL if there is none
+static struct table* load_table(const char *name) {
+    char path[64];
+    snprintf(path, sizeof path, "%s/%s.atb", TB_DIR, name);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return NULL;
+
+    struct table *t = new_table(name);
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (t && !fstat(fd, &st) && (size_t)st.st_size == TB_HEADER + t->size) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED || memcmp(data, TB_MAGIC, sizeof TB_MAGIC) ||
+            strncmp((char*)data + 8, t->name, 8)) {
+        if (data != MAP_FAILED) munmap(data, st.st_size);
+        free(t);
+        return NULL;
+    }
+
+    t->val = (unsigned char*)data + TB_HEADER;
+    t->maplen = st.st_size;
+    return t;
+}
+
+// finds a table among those in memory, or on disk if load is set (in which case
+// tables_lock must be held)
+// a table that isn't on disk is remembered as missing, so that probing its
+// material costs no more than probing one that's there
+static struct table* find_table(const char *name, int load) {
+    struct table *missing = NULL;
+    for (struct table *t = tables; t && !missing; t = t->next) {
+        if (strcmp(t->name, name)) continue;
+        if (t->val) return t;
+        missing = t;
+    }
+    if (!load || (missing && time(NULL) - missing->missed < TB_RETRY)) return NULL;
+
+    struct table *t = load_table(name);
+    if (t) {
+        t->next = tables;
+        tables = t;
+        return t;
+    }
+    if (!missing) {
+        missing = calloc(1, sizeof *missing);
+        strcpy(missing->name, name);
+        missing->next = tables;
+        tables = missing;
+    }
+    missing->missed = time(NULL);
+    return NULL;
+}
+
+// converts between positions and indices, a position being the squares of the
+// pieces in index order plus the side to move (0 for white, 1 for black)
+static size_t encode(struct table *t, int sq[TB_PIECES], int side) {
+    size_t idx = side;
+    for (int i = 0; i < t->n; ++i) idx = idx * 64 + sq[i];
+    return idx;
+}
+
+static int decode(struct table *t, size_t idx, int sq[TB_PIECES]) {
+    for (int i = t->n - 1; i >= 0; --i) sq[i] = idx % 64, idx /= 64;
+    return idx;
+}
+
+// fills in a board, returning 0 if two pieces share a square
+static int fill_board(struct table *t, int sq[TB_PIECES], int board[8][8]) {
+    memset(board, 0, 64 * sizeof **board);
+    for (int i = 0; i < t->n; ++i) {
+        if (board[X(sq[i])][Y(sq[i])]) return 0;
+        board[X(sq[i])][Y(sq[i])] = t->piece[i];
+    }
+    return 1;
+}
+
+// the index of a board in a table with the same material
+static size_t board_index(struct table *t, int board[8][8], int side) {
+    int sq[TB_PIECES], used[64] = {0};
+    for (int i = 0; i < t->n; ++i) {
+        for (int s = 0; s < 64; ++s) {
+            if (!used[s] && board[X(s)][Y(s)] == t->piece[i]) {
+                used[s] = 1;
+                sq[i] = s;
+                break;
+            }
+        }
+    }
+    return encode(t, sq, side);
+}
+
+// looks up a board with the given color to move in whichever table has its
+// material, with colors swapped if need be (which makes no difference without
+// pawns or castling), returning -1 if there is no such table
+static int lookup(int board[8][8], int color, int load) {
+    char name[8], flipped[8];
+    if (!board_material(board, name)) return -1;
+
+    struct table *t = find_table(name, load);
+    if (t) return t->val[board_index(t, board, color == -1)];
+
+    flip_name(name, flipped);
+    if (!(t = find_table(flipped, load))) return -1;
+    int swapped[8][8];
+    for (int i = 0; i < 8; ++i) for (int j = 0; j < 8; ++j) swapped[i][j] = -board[i][j];
+    return t->val[board_index(t, swapped, color == 1)];
+}
+
+// probes the tables for a position, returning 1 if the side to move wins, 0 for
+// a draw, -1 if it loses (with plies set to how long that takes) or TB_NONE
+int tb_probe(struct position *pos, int *plies) {
+    int color = position_color(pos);
+    if (castle_rights(pos, 1) || castle_rights(pos, -1)) return TB_NONE;
+
+    pthread_mutex_lock(&tables_lock);
+    int v = lookup(pos->pieces, color, 1);
+    pthread_mutex_unlock(&tables_lock);
+
+    if (v < 0 || v == TB_ILLEGAL) return TB_NONE;
+    if (plies) *plies = v >= TB_LOSS ? v - TB_LOSS : v;
+    return v == TB_DRAW ? 0 : v < TB_LOSS ? 1 : -1;
+}
+
+// the rest of this file generates tables
+//
+// every move that captures leaves the table (the capturing piece explodes as
+// well), so the moves within a table are exactly the quiet ones, which can be
+// undone by moving a piece back to any empty square it could have come from
+// the generator first visits every position once, counting its quiet moves
+// and scoring its captures from the smaller tables, which is the expensive
+// part and runs on several threads; then, starting from the mated positions,
+// each position lost in n plies makes all its predecessors won in n+1, and
+// each position won in n plies takes one move off the count of each of its
+// predecessors, which are lost once no moves are left (the predecessors
+// being found on several threads as well, see each_pred)
+
+struct gen {
+    struct table *t;
+    unsigned char *cnt;     // quiet moves not yet known to lose
+    unsigned char *ewin;    // fastest win by capturing, 0 if none
+    unsigned char *eloss;   // slowest loss by capturing
+    unsigned char *edraw;   // whether some capture draws
+    int threads, id;
+};
+
+static int has_king(int board[8][8], int color) {
+    for (int i = 0; i < 8; ++i) for (int j = 0; j < 8; ++j) if (board[i][j] == color*KING) return 1;
+    return 0;
+}
+
+static void init_position(struct gen *g, size_t idx) {
+    struct table *t = g->t;
+    int sq[TB_PIECES], board[8][8];
+    int color = decode(t, idx, sq) ? -1 : 1;
+    if (!fill_board(t, sq, board) || in_check(board, -color, -1, -1, -1, -1, 0)) {
+        t->val[idx] = TB_ILLEGAL;
+        return;
+    }
+
+    struct position pos;
+    memcpy(pos.pieces, board, sizeof board);
+    pos.ply = color == -1;
+    pos.cwk = pos.cwq = pos.cbk = pos.cbq = 1;
+    int moves[MAX_MOVES], n = generate_moves(&pos, moves), cnt = 0;
+    int ewin = 0, eloss = 0, edraw = 0;
+
+    for (int i = 0; i < n; ++i) {
+        int fx = X(FROM(moves[i])), fy = Y(FROM(moves[i])),
+            tx = X(TO(moves[i])), ty = Y(TO(moves[i]));
+        if (!board[tx][ty]) {
+            ++cnt;
+            continue;
+        }
+
+        int next[8][8];
+        memcpy(next, board, sizeof next);
+        simulate_move(next, fx, fy, tx, ty);
+        int v = has_king(next, -color) ? lookup(next, -color, 0) : TB_LOSS;
+        if (v < 0 || v == TB_ILLEGAL) continue;
+        if (v == TB_DRAW) edraw = 1;
+        else if (v >= TB_LOSS) {
+            if (!ewin || v - TB_LOSS + 1 < ewin) ewin = v - TB_LOSS + 1;
+        } else if (v + 1 > eloss) eloss = v + 1;
+    }
+
+    // mated positions are left to be sorted in as lost in 0 plies, since they
+    // have no moves at all
+    t->val[idx] = n || in_check(board, color, -1, -1, -1, -1, 0) ? UNRESOLVED : TB_DRAW;
+    g->cnt[idx] = cnt;
+    g->ewin[idx] = ewin;
+    g->eloss[idx] = eloss;
+    g->edraw[idx] = edraw;
+}
+
+// each thread takes every threads-th block of positions
+#define BLOCK 4096
+static void* init_thread(void *arg) {
+    struct gen *g = arg;
+    for (size_t b = g->id * BLOCK; b < g->t->size; b += (size_t)g->threads * BLOCK) {
+        for (size_t idx = b; idx < b + BLOCK && idx < g->t->size; ++idx) init_position(g, idx);
+    }
+    return NULL;
+}
+
+// fills preds with the positions from which a quiet move leads to idx
+static int unmoves(struct table *t, size_t idx, uint32_t *preds) {
+    static const int kx[] = { 1, 1, 1, 0, 0, -1, -1, -1 }, ky[] = { 1, 0, -1, 1, -1, 1, 0, -1 },
+                     nx[] = { 1, 1, 2, 2, -1, -1, -2, -2 }, ny[] = { 2, -2, 1, -1, 2, -2, 1, -1 };
+    int sq[TB_PIECES], board[8][8], n = 0;
+    int side = decode(t, idx, sq);
+    fill_board(t, sq, board);
+
+    // the side that just moved is the one not to move now
+    for (int i = 0; i < t->n; ++i) {
+        if ((t->piece[i] < 0) == side) continue;
+        int type = abs(t->piece[i]), x = X(sq[i]), y = Y(sq[i]), from = sq[i];
+        for (int d = 0; d < 8; ++d) {
+            int dx = type == KNIGHT ? nx[d] : kx[d], dy = type == KNIGHT ? ny[d] : ky[d];
+            if (type == ROOK && dx && dy) continue;
+            if (type == BISHOP && !(dx && dy)) continue;
+            int slide = type == QUEEN || type == ROOK || type == BISHOP;
+            for (int xx = x + dx, yy = y + dy; xx >= 0 && xx < 8 && yy >= 0 && yy < 8 &&
+                    !board[xx][yy]; xx += dx, yy += dy) {
+                sq[i] = SQ(xx, yy);
+                size_t p = encode(t, sq, !side);
+                if (t->val[p] != TB_ILLEGAL) preds[n++] = p;
+                if (!slide) break;
+            }
+        }
+        sq[i] = from;
+    }
+    return n;
+}
+
+// lists of positions, one for each number of plies
+struct list {
+    uint32_t *idx;
+    size_t len, cap;
+};
+
+static void push(struct list *l, uint32_t idx) {
+    if (l->len == l->cap) l->idx = realloc(l->idx, (l->cap = l->cap ? l->cap * 2 : 256) * sizeof *l->idx);
+    l->idx[l->len++] = idx;
+}
+
+// the predecessors of part of a list, worked out on a thread of its own
+struct unmover {
+    struct table *t;
+    const uint32_t *idx;
+    size_t n;
+    struct list preds;
+};
+
+static void* unmove_thread(void *arg) {
+    struct unmover *u = arg;
+    uint32_t preds[256];
+    u->preds.len = 0;
+    for (size_t i = 0; i < u->n; ++i) {
+        int n = unmoves(u->t, u->idx[i], preds);
+        for (int j = 0; j < n; ++j) push(&u->preds, preds[j]);
+    }
+    return NULL;
+}
+
+// calls fn on every predecessor of the positions in l, in chunks whose
+// predecessors are found on all the threads (which only read the table) and
+// then handed to fn on this one (which may change it)
+#define UNMOVE_CHUNK 65536
+static void each_pred(struct table *t, struct list *l, int threads,
+        void (*fn)(uint32_t pred, void *data), void *data) {
+    struct unmover *us = calloc(threads, sizeof *us);
+    pthread_t *tids = malloc(threads * sizeof *tids);
+    int *started = malloc(threads * sizeof *started);
+    for (size_t start = 0; start < l->len; start += UNMOVE_CHUNK) {
+        size_t len = l->len - start < UNMOVE_CHUNK ? l->len - start : UNMOVE_CHUNK;
+        for (int i = 0; i < threads; ++i) {
+            us[i].t = t;
+            us[i].idx = l->idx + start + len * i / threads;
+            us[i].n = len * (i + 1) / threads - len * i / threads;
+        }
+        for (int i = 1; i < threads; ++i) {
+            started[i] = !pthread_create(&tids[i], NULL, unmove_thread, &us[i]);
+            if (!started[i]) unmove_thread(&us[i]);
+        }
+        unmove_thread(&us[0]);
+        for (int i = 1; i < threads; ++i) if (started[i]) pthread_join(tids[i], NULL);
+
+        for (int i = 0; i < threads; ++i) {
+            for (size_t j = 0; j < us[i].preds.len; ++j) fn(us[i].preds.idx[j], data);
+        }
+    }
+    for (int i = 0; i < threads; ++i) free(us[i].preds.idx);
+    free(us);
+    free(tids);
+    free(started);
+}
+
+// what the propagation of one number of plies works with
+struct step {
+    struct gen *g;
+    struct list *won, *lost;
+    int plies, err;
+};
+
+// a predecessor of a lost position is won a ply later
+static void won_from(uint32_t p, void *data) {
+    struct step *s = data;
+    if (s->g->t->val[p] != UNRESOLVED) return;
+    if (s->plies + 1 < TB_LOSS) push(&s->won[s->plies+1], p);
+    else s->err = 1;
+}
+
+// and one of a won position loses once all its moves are known to
+static void lost_from(uint32_t p, void *data) {
+    struct step *s = data;
+    struct gen *g = s->g;
+    if (g->t->val[p] != UNRESOLVED || --g->cnt[p] || g->ewin[p] || g->edraw[p]) return;
+    int when = s->plies + 1 > g->eloss[p] ? s->plies + 1 : g->eloss[p];
+    if (when < MAX_LOSS) push(&s->lost[when], p);
+    else s->err = 1;
+}
+
+// writes the table to a temporary file first, so that a failed or interrupted
+// write never leaves a truncated table behind for probes to trust
+static int write_table(struct table *t) {
+    char path[64], tmp[68], header[TB_HEADER] = TB_MAGIC;
+    mkdir(TB_DIR, 0777);
+    snprintf(path, sizeof path, "%s/%s.atb", TB_DIR, t->name);
+    snprintf(tmp, sizeof tmp, "%s.tmp", path);
+    strncpy(header + 8, t->name, 8);
+
+    FILE *f = fopen(tmp, "wb");
+    if (!f) return -1;
+    int err = fwrite(header, 1, TB_HEADER, f) != TB_HEADER;
+    err |= fwrite(t->val, 1, t->size, f) != t->size;
+    err |= fclose(f) != 0;
+    if (!err) err = rename(tmp, path) != 0;
+    if (err) {
+        perror(path);
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+static struct table* generate(const char *material, int threads) {
+    struct table *t = new_table(material);
+    if (!t) return NULL;
+    char flipped[8];
+    flip_name(t->name, flipped);
+
+    struct table *have = find_table(t->name, 1);
+    if (!have) have = find_table(flipped, 1);
+    if (have) {
+        free(t);
+        return have;
+    }
+
+    // every capture leads to a table with a subset of the pieces (and both
+    // kings), so make sure those exist first
+    for (int mask = 0; mask < 1 << t->n; ++mask) {
+        int count[2][5] = {{0}}, sub = 1;
+        char name[8];
+        for (int i = 0; i < t->n; ++i) {
+            if (abs(t->piece[i]) == KING) sub &= (mask >> i) & 1;
+            if (!((mask >> i) & 1)) continue;
+            int tt = 0;
+            while (types[tt] != abs(t->piece[i])) ++tt;
+            ++count[t->piece[i] < 0][tt];
+        }
+        if (!sub || mask == (1 << t->n) - 1 || !material_name(count, name)) continue;
+        if (!generate(name, threads)) {
+            free(t);
+            return NULL;
+        }
+    }
+
+    fprintf(stderr, "atop tb: generating %s\n", t->name);
+    struct gen g = { t, malloc(t->size), malloc(t->size), malloc(t->size), malloc(t->size), threads, 0 };
+    t->val = malloc(t->size);
+
+    pthread_t *tids = malloc(threads * sizeof *tids);
+    struct gen *args = malloc(threads * sizeof *args);
+    for (int i = 0; i < threads; ++i) {
+        args[i] = g;
+        args[i].id = i;
+        pthread_create(&tids[i], NULL, init_thread, &args[i]);
+    }
+    for (int i = 0; i < threads; ++i) pthread_join(tids[i], NULL);
+    free(tids);
+    free(args);
+
+    // sort the positions decided by captures alone into their lists
+    struct list won[TB_LOSS] = {{0}}, lost[TB_LOSS] = {{0}};
+    int err = 0;
+    for (size_t idx = 0; idx < t->size; ++idx) {
+        if (t->val[idx] != UNRESOLVED) continue;
+        if (g.ewin[idx]) push(&won[g.ewin[idx]], idx);
+        else if (!g.cnt[idx] && !g.edraw[idx]) {
+            if (g.eloss[idx] < MAX_LOSS) push(&lost[g.eloss[idx]], idx);
+            else err = 1;
+        }
+    }
+
+    for (int plies = 0; plies < TB_LOSS; ++plies) {
+        struct list now_won = {0}, now_lost = {0};
+        for (size_t i = 0; i < won[plies].len; ++i) {
+            uint32_t idx = won[plies].idx[i];
+            if (t->val[idx] == UNRESOLVED) t->val[idx] = plies, push(&now_won, idx);
+        }
+        for (size_t i = 0; i < lost[plies].len; ++i) {
+            uint32_t idx = lost[plies].idx[i];
+            if (t->val[idx] == UNRESOLVED) t->val[idx] = TB_LOSS + plies, push(&now_lost, idx);
+        }
+        free(won[plies].idx);
+        free(lost[plies].idx);
+
+        struct step step = { &g, won, lost, plies, 0 };
+        each_pred(t, &now_lost, threads, won_from, &step);
+        each_pred(t, &now_won, threads, lost_from, &step);
+        err |= step.err;
+        free(now_won.idx);
+        free(now_lost.idx);
+    }
+
+    // whatever could not be forced either way is a draw
+    for (size_t idx = 0; idx < t->size; ++idx) {
+        if (t->val[idx] == UNRESOLVED) t->val[idx] = TB_DRAW;
+    }
+    free(g.cnt);
+    free(g.ewin);
+    free(g.eloss);
+    free(g.edraw);
+
+    if (err) fprintf(stderr, "atop tb: %s has wins too long to store\n", t->name);
+    if (err || write_table(t)) {
+        free(t->val);
+        free(t);
+        return NULL;
+    }
+    t->next = tables;
+    tables = t;
+    return t;
+}
+
+// generates the table for the given material, and any smaller ones it needs,
+// returning 0 on success
+int tb_generate(const char *material, int threads) {
+    pthread_mutex_lock(&tables_lock);
+    struct table *t = generate(material, threads);
+    pthread_mutex_unlock(&tables_lock);
+    return t ? 0 : -1;
+}
+
+int cmd_tb(int argc, char **argv) {
+    int threads = sysconf(_SC_NPROCESSORS_ONLN), opt;
+    while ((opt = getopt(argc, argv, "j:")) != -1) {
+        switch (opt) {
+            case 'j': threads = strtol(optarg, NULL, 10); break;
+            default: optind = argc + 1;
+        }
+    }
+    if (optind >= argc || threads < 1) {
+        fputs("usage: atop tb [-j threads] MATERIAL...\n", stderr);
+        return 1;
+    }
+
+    for (int i = optind; i < argc; ++i) {
+        if (tb_generate(argv[i], threads)) {
+            fprintf(stderr, "atop tb: can't generate %s (pawnless, with at most %d pieces)\n",
+                    argv[i], TB_PIECES);
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,51 @@
+/*
+ * atop - opening database for atomic chess
+ * Copyright (C) 2018  Keyboard Fire <andy@keyboardfire.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TB_H__
+#define __TB_H__
+
+struct position;
+
+// endgame tablebases for pawnless material with at most this many pieces
+// (kings included), named like KQvKR and kept in the tb directory
+#define TB_PIECES 4
+#define TB_DIR "tb"
+
+// each table is a 16 byte header (the magic below, then the name padded with
+// NULs) followed by one byte per position, indexed by the side to move and
+// then the square of each piece in the order of the name, each byte being
+//
+//     0         draw
+//     1..127    the side to move wins, exploding the enemy king or mating
+//               after this many plies
+//     128..253  the side to move loses after (byte - 128) plies
+//     255       impossible (the side not to move is in check, or two pieces
+//               are on the same square)
+#define TB_MAGIC   "ATOPTB1"
+#define TB_HEADER  16
+#define TB_DRAW    0
+#define TB_LOSS    128
+#define TB_ILLEGAL 255
+
+// what tb_probe returns when no table covers the position
+#define TB_NONE -2
+
+int tb_generate(const char *material, int threads);
+int tb_probe(struct position *pos, int *plies);
+
+#endif
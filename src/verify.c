@@ -0,0 +1,330 @@
+/*
+ * atop - opening database for atomic chess
+ * Copyright (C) 2018  Keyboard Fire <andy@keyboardfire.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// atop verify - checks a database: that the file isn't damaged, and that every
+// line in it can be replayed, i.e. each move is on the board, legal in the
+// position it's stored from and stored only once there
+//
+// a bad move is reported along with the line leading to it, and with -p it's
+// removed together with everything after it and the database saved again
+// (which also rewrites a damaged file with as much of it as could be read);
+// a move stored twice is the exception, since the lines after the second copy
+// are as good as any, so they're checked too and merged into the first copy
+//
+// the totals kept on each node (see struct move) are also added up again and
+// compared, since a mistake in keeping them is only seen as a wrong number in
+// the book tab otherwise; they aren't stored in the file, so this checks the
+// loading code rather than the database
+//
+// the tree is split up like for loading (see db_split_depth), with the moves
+// down to that depth checked first and the subtrees below them shared out
+// among the threads
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "chess.h"
+#include "cmd.h"
+#include "db.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// how many moves of the line to a bad move are shown
+#define SHOWN_PLIES 16
+
+// a bad move, found while checking the subtree with index task (the spine is
+// task 0), after seq others in it
+struct bad {
+    struct move *node;
+    const char *why;
+    size_t task, seq;
+};
+
+// a node whose children are left for the threads, with the position after it
+struct task {
+    struct move *node;
+    struct position pos;
+};
+
+// the state shared by the checking threads
+struct verifier {
+    struct task *tasks;
+    size_t ntasks, next;
+    size_t split;           // how deep the spine goes (0 for no limit)
+    pthread_mutex_t lock;
+};
+
+struct checker {
+    struct verifier *v;
+    struct bad *bad;
+    size_t nbad, cap, task, seq;
+    size_t checked;
+};
+
+// the moves after some node that are still to be checked, and the position
+// they're made from
+struct frame {
+    struct move *next;
+    size_t depth;
+    struct position pos;
+    int color, castle;
+};
+
+static void add_bad(struct checker *c, struct move *node, const char *why) {
+    if (c->nbad == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 64;
+        c->bad = realloc(c->bad, c->cap * sizeof *c->bad);
+    }
+    c->bad[c->nbad++] = (struct bad){ node, why, c->task, c->seq++ };
+}
+
+static void add_task(struct verifier *v, struct move *node, struct position *pos) {
+    if (v->ntasks % 1024 == 0) v->tasks = realloc(v->tasks, (v->ntasks + 1024) * sizeof *v->tasks);
+    v->tasks[v->ntasks++] = (struct task){ node, *pos };
+}
+
+static void enter(struct frame *f, struct move *node, size_t depth, struct position *pos) {
+    f->next = node->child;
+    f->depth = depth;
+    f->pos = *pos;
+    f->color = position_color(pos);
+    f->castle = castle_rights(pos, f->color);
+}
+
+// (only the moves of the piece moved are worked out, like when it's clicked,
+// which is a lot cheaper than generate_moves)
+static int legal(struct frame *f, struct move *m) {
+    int fx = X(m->from), fy = Y(m->from), tx = X(m->to), ty = Y(m->to);
+    int piece = f->pos.pieces[fx][fy];
+    if (piece * f->color <= 0) return 0;
+    int arr[8][8] = {{0}};
+    update_legal(arr, f->pos.pieces, abs(piece), f->color, fx, fy, 1, f->castle);
+    return arr[tx][ty];
+}
+
+static const char stored_twice[] = "move stored twice";
+
+// returns the earlier copy of m stored under the same parent, if any
+static struct move* first_copy(struct move *m) {
+    for (struct move *s = m->parent->child; s != m; s = s->next) {
+        if (s->from == m->from && s->to == m->to) return s;
+    }
+    return NULL;
+}
+
+// checks everything below top, whose children are made from pos at depth;
+// with c->v->split set, the children of nodes at that depth are made into
+// tasks instead
+// (without recursion, since lines can be arbitrarily long; a frame is only
+// kept for the nodes that still have siblings to go)
+static void check_tree(struct checker *c, struct move *top, size_t depth, struct position *pos) {
+    size_t nframes = 1, cap = 16;
+    struct frame *frames = malloc(cap * sizeof *frames);
+    enter(&frames[0], top, depth, pos);
+
+    while (nframes) {
+        struct frame *f = &frames[nframes-1];
+        struct move *m = f->next;
+        if (!m) {
+            --nframes;
+            continue;
+        }
+        f->next = m->next;
+        ++c->checked;
+
+        if (m->from >= 64 || m->to >= 64) {
+            add_bad(c, m, "square off the board");
+            continue;
+        }
+        if (!legal(f, m)) {
+            add_bad(c, m, "illegal move");
+            continue;
+        }
+        if (first_copy(m)) add_bad(c, m, stored_twice);
+        if (!m->child) continue;
+
+        struct position after = f->pos;
+        position_move(&after, X(m->from), Y(m->from), X(m->to), Y(m->to));
+        if (c->v->split && f->depth == c->v->split) {
+            add_task(c->v, m, &after);
+            continue;
+        }
+
+        // the last sibling's frame is done with, so its children can have it
+        size_t d = f->depth + 1;
+        if (f->next) {
+            if (nframes == cap) frames = realloc(frames, (cap *= 2) * sizeof *frames);
+            f = &frames[nframes++];
+        }
+        enter(f, m, d, &after);
+    }
+    free(frames);
+}
+
+static void* check_thread(void *arg) {
+    struct checker *c = arg;
+    for (;;) {
+        pthread_mutex_lock(&c->v->lock);
+        size_t i = c->v->next++;
+        pthread_mutex_unlock(&c->v->lock);
+        if (i >= c->v->ntasks) return NULL;
+
+        c->task = i + 1;
+        c->seq = 0;
+        check_tree(c, c->v->tasks[i].node, 0, &c->v->tasks[i].pos);
+    }
+}
+
+static int by_place(const void *a, const void *b) {
+    const struct bad *x = a, *y = b;
+    if (x->task != y->task) return x->task < y->task ? -1 : 1;
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+static void print_line(struct move *node) {
+    size_t plies = 0;
+    for (struct move *m = node; m->parent; m = m->parent) ++plies;
+
+    // the moves are found from the end, so fill the buffer from the back
+    char buf[SHOWN_PLIES * 5 + 4];
+    size_t pos = sizeof buf, shown = 0;
+    for (struct move *m = node; m->parent && shown < SHOWN_PLIES; m = m->parent, ++shown) {
+        char mv[5];
+        if (m->from < 64 && m->to < 64) format_move(MOVE(m->from, m->to), mv);
+        else strcpy(mv, "????");
+        pos -= 5;
+        memcpy(buf + pos, mv, 4);
+        buf[pos+4] = shown ? ' ' : '\0';
+    }
+    if (shown < plies) memcpy(buf + (pos -= 4), "... ", 4);
+    printf("ply %zu: %s", plies, buf + pos);
+}
+
+static size_t count_below(struct move *node) {
+    size_t n = 0;
+    for (struct move *m = node->child; m; ) {
+        ++n;
+        if (m->child) {
+            m = m->child;
+            continue;
+        }
+        while (m != node && !m->next) m = m->parent;
+        m = m == node ? NULL : m->next;
+    }
+    return n;
+}
+
+int cmd_verify(int argc, char **argv) {
+    int prune = 0, threads = sysconf(_SC_NPROCESSORS_ONLN), opt;
+    while ((opt = getopt(argc, argv, "j:p")) != -1) {
+        switch (opt) {
+            case 'j': threads = strtol(optarg, NULL, 10); break;
+            case 'p': prune = 1; break;
+            default: threads = 0; break;
+        }
+    }
+    if (threads < 1 || argc - optind > 1) {
+        fputs("usage: atop verify [-j threads] [-p] [DATABASE]\n", stderr);
+        return 1;
+    }
+    const char *path = optind < argc ? argv[optind] : "atop.db";
+
+    if (access(path, F_OK)) {
+        perror(path);
+        return 1;
+    }
+    // nobody may save in between checking and pruning
+    int lock = -1;
+    if (prune && (lock = db_lock(path)) == -1) {
+        perror(path);
+        return 1;
+    }
+    db_threads = threads;
+    struct move *root = db_load(path);
+    const char *damage = db_damage;
+    if (damage) printf("%s: %s\n", path, damage);
+
+    struct position start;
+    position_init(&start);
+    struct verifier v = { NULL, 0, 0, db_split_depth(root), PTHREAD_MUTEX_INITIALIZER };
+    struct checker *cs = calloc(threads, sizeof *cs);
+    for (int i = 0; i < threads; ++i) cs[i].v = &v;
+    check_tree(&cs[0], root, 1, &start);
+    v.split = 0;
+
+    pthread_t *tids = malloc(threads * sizeof *tids);
+    for (int i = 1; i < threads; ++i) pthread_create(&tids[i], NULL, check_thread, &cs[i]);
+    check_thread(&cs[0]);
+    for (int i = 1; i < threads; ++i) pthread_join(tids[i], NULL);
+    free(tids);
+
+    // gathered in the order they'd be found on one thread
+    size_t nbad = 0, checked = 0, after = 0;
+    for (int i = 0; i < threads; ++i) nbad += cs[i].nbad, checked += cs[i].checked;
+    struct bad *bad = malloc((nbad ? nbad : 1) * sizeof *bad);
+    nbad = 0;
+    for (int i = 0; i < threads; ++i) {
+        if (cs[i].nbad) memcpy(bad + nbad, cs[i].bad, cs[i].nbad * sizeof *bad);
+        nbad += cs[i].nbad;
+        free(cs[i].bad);
+    }
+    free(cs);
+    free(v.tasks);
+    qsort(bad, nbad, sizeof *bad, by_place);
+    for (size_t i = 0; i < nbad; ++i) {
+        print_line(bad[i].node);
+        printf(": %s\n", bad[i].why);
+        if (bad[i].why != stored_twice) after += count_below(bad[i].node);
+    }
+
+    struct move *off = db_check_totals(root);
+    if (off && off != root) {
+        print_line(off);
+        printf(": totals don't match the moves below\n");
+    } else if (off) printf("%s: totals don't match the moves below\n", path);
+
+    printf("%s: %zu moves checked, %zu bad", path, checked, nbad);
+    if (nbad) printf(" (with %zu moves after them)", after);
+    printf("\n");
+
+    int status = nbad || damage;
+    if (prune && status) {
+        // last found first, so that everything under a copy is dealt with
+        // before the copy itself is merged (a bad move's copies are just as
+        // bad, so merging them away first doesn't keep anything)
+        size_t before = root->below;
+        for (size_t i = nbad; i--; ) {
+            struct move *first = first_copy(bad[i].node);
+            if (first) db_fold(first, bad[i].node);
+            else db_remove(bad[i].node);
+        }
+        if (db_save(root, path)) {
+            perror(path);
+        } else {
+            printf("%s: removed %zu moves and saved\n", path, before - root->below);
+            status = 0;
+        }
+    }
+    free(bad);
+    db_free(root);
+    db_unlock(lock);
+    return status || off;
+}